@@ -2,23 +2,18 @@
 
 constexpr uint32_t GroupBufferSize = sizeof(core::entity) * 5;
 
-inline void* buffer_malloc(size_t size)
-{
-	return ::malloc(size);
-}
-
-inline void buffer_free(void* ptr)
-{
-	return ::free(ptr);
-}
+//overflow storage comes from the memory resource of current memory_scope
+ECS_API void* buffer_malloc(size_t size);
+ECS_API void buffer_free(void* ptr);
 
+//size and capacity are 32 bit, fits the padding after d on 64 bit targets
 struct buffer
 {
 	char* d;
-	uint16_t size;
-	uint16_t capacity;
+	uint32_t size;
+	uint32_t capacity;
 
-	buffer(uint16_t cap)
+	buffer(uint32_t cap)
 	{
 		d = nullptr;
 		capacity = cap;
@@ -37,22 +32,23 @@ struct buffer
 		else return d;
 	}
 
-	void push(const void* dd, uint16_t length)
+	void push(const void* dd, uint32_t length)
 	{
-		if (size + length >= capacity)
-			grow();
+		if (size + length > capacity)
+			grow(size + length);
 		memcpy(data() + size, dd, length);
 		size += length;
 	}
 
-	void* pop(uint16_t length)
+	void* pop(uint32_t length)
 	{
 		return data() + (size -= length);
 	}
 
-	void grow(uint16_t hint = 0)
+	void grow(uint32_t hint = 0)
 	{
-		uint16_t newCap = (uint16_t)std::max((int)hint, capacity * 2);
+		size_t doubled = std::min<size_t>((size_t)capacity * 2, UINT32_MAX);
+		uint32_t newCap = (uint32_t)std::max<size_t>(hint, doubled);
 		char* newBuffer = (char*)buffer_malloc(newCap);
 		memcpy(newBuffer, data(), size);
 		if (d != nullptr)
@@ -61,15 +57,20 @@ struct buffer
 		capacity = newCap;
 	}
 
-	void shrink(uint16_t inlineSize)
+	void shrink(uint32_t inlineSize)
 	{
+		if (d == nullptr)
+			return;
 		if (size < inlineSize)
 		{
+			//move back to inline storage
+			memcpy((char*)(this + 1), d, size);
 			buffer_free(d);
 			d = nullptr;
+			capacity = inlineSize;
 			return;
 		}
-		uint16_t newCap = capacity;
+		uint32_t newCap = capacity;
 		while (newCap > size * 2)
 			newCap /= 2;
 		if (newCap != capacity)
@@ -197,7 +198,7 @@ public:
 	{
 		return ((const T*)_data->data())[i];
 	}
-	uint16_t size() const
+	uint32_t size() const
 	{
 		return _data->size / sizeof(T);
 	}
@@ -232,26 +233,26 @@ public:
 	}
 	T& last()
 	{
-		((T*)_data->data())[size()];
+		return ((T*)_data->data())[size() - 1];
 	}
 	const T& last() const
 	{
-		((const T*)_data->data())[size()];
+		return ((const T*)_data->data())[size() - 1];
 	}
-	void shrink(uint16_t inlineSize) noexcept
+	void shrink(uint32_t inlineSize) noexcept
 	{
 		_data->shrink(inlineSize);
 	}
-	void reserve(uint16_t newSize) noexcept
+	void reserve(uint32_t newSize) noexcept
 	{
 		if (newSize * sizeof(T) > _data->capacity)
-			_data->grow(newSize * sizeof(T));
+			_data->grow(uint32_t(newSize * sizeof(T)));
 	}
 	T* data()
 	{
 		return (T*)_data->data();
 	}
-	void resize(uint16_t newSize) noexcept
+	void resize(uint32_t newSize) noexcept
 	{
 		reserve(newSize);
 		_data->size = newSize * sizeof(T);
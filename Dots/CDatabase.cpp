@@ -374,7 +374,7 @@ void serialize_world(world* wrd, serializer_i s)
 void deserialize_world(world* wrd, serializer_i s)
 {
 	auto sw = cast(s);
-	return cast(wrd)->deserialize(&sw);
+	cast(wrd)->deserialize(&sw);
 }
 
 //clear
@@ -8,12 +8,21 @@ struct entity
 {
 	union
 	{
+#ifdef ENABLE_64BIT_ENTITY
+		uint64_t value;
+		struct
+		{
+			uint64_t version : 24;
+			uint64_t id : 40;
+		};
+#else
 		uint32_t value;
 		struct
 		{
 			uint32_t version : 8;
 			uint32_t id : 24;
 		};
+#endif
 	};
 };
 typedef struct chunk chunk;
@@ -8,6 +8,7 @@ struct chunk_vector_base
 	size_t size = 0;
 	size_t chunkCapacity = kChunkSize;
 	void** data = nullptr;
+	memory_resource_i* resource = nullptr; //segments come from context bins if null
 
 	void grow();
 	void shrink(size_t n);
@@ -137,10 +138,12 @@ struct chunk_vector : chunk_vector_base
 	}
 	void resize(size_t newSize)
 	{
+		//keep reserved segments while growing
+		bool growing = newSize > size;
 		size = newSize;
 		if (newSize > chunkSize * kChunkCapacity)
 			reserve(newSize);
-		else
+		else if (!growing)
 			shrink();
 	}
 	template<class... Ts>
@@ -20,6 +20,10 @@ pipeline::pipeline(world&& ctx)
 	{
 		update_archetype(at, add);
 	};
+	on_defragment = [this](archetype* at)
+	{
+		sync_archetype(at);
+	};
 	for (auto at : get_archetypes())
 	{
 		std::unique_ptr<dependency_entry[]> entries{ new dependency_entry[at->firstTag + 1] };
@@ -34,6 +38,10 @@ pipeline::pipeline(pipeline&& ppl)
 	{
 		update_archetype(at, add);
 	};
+	on_defragment = [this](archetype* at)
+	{
+		sync_archetype(at);
+	};
 }
 
 void pipeline::update_archetype(archetype* at, bool add)
@@ -50,11 +58,13 @@ void pipeline::update_archetype(archetype* at, bool add)
 pipeline::~pipeline()
 {
 	on_archetype_update = std::function<void(archetype*, bool)>();
+	on_defragment = std::function<void(archetype*)>();
 }
 
 world pipeline::release()
 {
 	on_archetype_update = std::function<void(archetype*, bool)>();
+	on_defragment = std::function<void(archetype*)>();
 	return std::move(*this);
 }
 
@@ -142,7 +152,7 @@ std::pair<chunk_vector<task>, chunk_vector<task_group>> pipeline::create_tasks(p
 	group.begin = group.end = 0;
 	int batch = batchCount;
 	forloop(i, 0, k.archetypeCount)
-		for (auto c : k.ctx.query(k.archetypes[i], k.filter.chunkFilter))
+		for (auto c : k.ctx.each_chunk(k.archetypes[i], k.filter.chunkFilter))
 		{
 			uint32_t allocated = 0;
 			while (allocated != c->get_count())
@@ -183,7 +193,7 @@ uint32_t pass::calc_size() const
 			ctx.sync_archetype(archetypes[i]);
 	auto& wrd = (world&)ctx;
 	forloop(i, 0, archetypeCount)
-		for (auto j : wrd.query(archetypes[i], filter.chunkFilter))
+		for (auto j : wrd.each_chunk(archetypes[i], filter.chunkFilter))
 			entityCount += j->get_count();
 	return entityCount;
 }
@@ -459,6 +469,13 @@ chunk_vector<chunk*> pipeline::query(archetype* g, const chunk_filter& filter)
 	return world::query(g, filter);
 }
 
+chunk_range pipeline::each_chunk(archetype* g, const chunk_filter& filter)
+{
+	if(filter.changed.length > 0)
+		sync_archetype(g); //同步 Timestamp
+	return world::each_chunk(g, filter);
+}
+
 
 const void* pipeline::get_component_ro(entity e, type_index type) const noexcept
 {
@@ -559,6 +576,7 @@ chunk_vector<entity> pipeline::gather_reference(entity e)
 }
 void pipeline::serialize(serializer_i* s, entity e)
 {
+	archive_version(s);
 	auto group_data = (buffer*)get_component_ro(e, get_builtin().group_id);
 	if (group_data == nullptr)
 	{
@@ -590,6 +608,8 @@ entity pipeline::deserialize(serializer_i* s, patcher_i* patcher)
 	{
 		return s.c->get_entities()[s.start];
 	};
+	if (!archive_version(s))
+		return NullEntity;
 	auto slice = deserialize_single(s, patcher);
 	entity src = first_entity(slice);
 	auto group_data = (buffer*)get_component_ro(src, get_builtin().group_id);
@@ -667,16 +687,21 @@ void pipeline::serialize(serializer_i* s)
 	sync_all();
 	world::serialize(s);
 }
-void pipeline::deserialize(serializer_i* s)
+bool pipeline::deserialize(serializer_i* s)
 {
 	sync_all();
-	world::deserialize(s);
+	return world::deserialize(s);
 }
 void pipeline::merge_chunks()
 {
 	sync_all();
 	world::merge_chunks();
 }
+void pipeline::reserve(uint32_t entityCount, const archetype_hint* hints, uint32_t hintCount, prefault_mode mode)
+{
+	sync_all();
+	world::reserve(entityCount, hints, hintCount, mode);
+}
 
 int filters::get_size() const
 {
@@ -696,33 +721,20 @@ filters filters::clone(char*& buffer) const
 
 void command_buffer::local::cast(type_diff diff)
 {
-	thread_local char buffer[100];
 	auto e = entities.size - 1;
+	auto d = types.intern(diff);
 	if (casts.size > 0 && casts.last().e == e)
 	{
 		auto& origin = casts.last().diff;
-		type_diff newMerged = type_diff::merge(origin, diff, buffer);
-		char* data = (char*)storage.push(newMerged.get_size());
-		auto d = newMerged.clone(data);
-		origin = newMerged;
+		origin = types.merge(origin, d);
 	}
 	else if (allocates.size > 0 && allocates.last().e == e)
 	{
 		auto& origin = allocates.last().type;
-		char* buf = buffer;
-		auto shrinked = entity_type::substract(origin, diff.shrink, buf);
-		buf += shrinked.get_size();
-		auto extended = entity_type::merge(origin, diff.extend, buf);
-		char* data = (char*)storage.push(extended.get_size());
-		auto d = extended.clone(data);
-		origin = extended;
+		origin = types.apply(origin, d);
 	}
 	else
-	{
-		char* data = (char*)storage.push(diff.get_size());
-		auto d = diff.clone(data);
 		casts.push(e, d);
-	}
 }
 
 void command_buffer::local::set_component(type_index type, void* data, size_t size)
@@ -741,11 +753,10 @@ void command_buffer::local::patch_component(type_index type)
 
 core::entity command_buffer::local::allocate(entity_type type)
 {
-	char* data = (char*)storage.push(type.get_size());
-	auto d = type.clone(data);
+	auto t = types.intern(type);
 	auto e = core::entity::make_transient(global->allocates++);
 	entities.push(e);
-	allocates.push(entities.size - 1, d);
+	allocates.push(entities.size - 1, t);
 	return e;
 }
 
@@ -769,6 +780,7 @@ void command_buffer::local::destroy(core::entity e)
 
 void command_buffer::execute(pipeline& ppl)
 {
+	auto scope = ppl.make_scope();
 	std::vector<core::entity> newEnts;
 	newEnts.resize(allocates);
 	for (int i = 0; i < locals.size; ++i)
@@ -779,12 +791,12 @@ void command_buffer::execute(pipeline& ppl)
 		while (iter != end)
 		{
 			auto rb = iter;
-			entity_type type = iter->type;
+			auto type = iter->type;
 			size_t count = 1;
 			iter++;
 			while (iter != end && iter->type == type)
-				count++;
-			for (auto s : ppl.allocate(type, count))
+				(count++, iter++);
+			for (auto s : ppl.allocate(type->type, count))
 			{
 				auto es = ppl.get_entities(s);
 				for (uint32_t j = 0; j < s.count; ++j)
@@ -806,7 +818,7 @@ void command_buffer::execute(pipeline& ppl)
 			size_t count = 1;
 			iter++;
 			while (iter != end && iter->source == source)
-				count++;
+				(count++, iter++);
 			for (auto s : ppl.instantiate(source, count))
 			{
 				auto es = ppl.get_entities(s);
@@ -829,17 +841,19 @@ void command_buffer::execute(pipeline& ppl)
 		auto end = loc.casts.end();
 		while (iter != end)
 		{
-			type_diff diff = iter->diff;
+			auto diff = iter->diff;
 			chunk_slice s = ppl.as_slice(loc.entities[iter->e]);
 			iter++;
 			auto canMerge = [&]
 			{
+				if (diff != iter->diff)
+					return false;
 				chunk_slice s2 = ppl.as_slice(loc.entities[iter->e]);
-				return diff == iter->diff && s2.c == s.c && s2.start == s.start + s.count;
+				return s2.c == s.c && s2.start == s.start + s.count;
 			};
 			while (iter != end && canMerge())
-				s.count++;
-			ppl.cast(s, diff);
+				(s.count++, iter++);
+			ppl.cast(s, diff->get());
 		}
 	}
 	for (int i = 0; i < locals.size; ++i)
@@ -876,7 +890,7 @@ void command_buffer::execute(pipeline& ppl)
 				return s2.c == s.c && s2.start == s.start + s.count;
 			};
 			while (iter != end && canMerge())
-				s.count++;
+				(s.count++, iter++);
 			ppl.destroy(s);
 		}
 	}
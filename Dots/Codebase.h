@@ -42,6 +42,7 @@ def get_##Name##_v = get_##Name<T>::value;
 		DEFINE_GETTER(buffer_capacity, 1);
 		DEFINE_GETTER(entity_refs, gsl::span<intptr_t>{});
 		DEFINE_GETTER(vtable, component_vtable{});
+		DEFINE_GETTER(column_alignment, 0);
 #undef	DEFINE_GETTER
 
 		template<template<class...> class TP, class T>
@@ -99,6 +100,7 @@ def get_##Name##_v = get_##Name<T>::value;
 			desc.entityRefs = entityRefs.data();
 			desc.entityRefCount = (uint16_t)entityRefs.size();
 			desc.alignment = alignof(T);
+			desc.columnAlignment = (uint16_t)get_column_alignment_v<T>;
 			desc.name = typeid(T).name();
 			desc.vtable = get_vtable_v<T>;
 			return cid<T> = register_type(desc);
@@ -266,8 +268,7 @@ def get_##Name##_v = get_##Name<T>::value;
 		{
 			static constexpr hana::tuple<params...> paramList;
 			static constexpr auto compList = hana::transform(paramList, [](const auto p) { return p.comp_type; });
-			operation(hana::tuple<params...> ps, const pass& k, const task& t)
-			:ctx(k), gid(t.gid), slice(t.slice), indexInKernel(t.indexInKernel){}
+			operation(hana::tuple<params...> ps, const pass& k, const task& t);
 			template<class T>
 			constexpr auto param_id();
 			template<class T>
@@ -302,6 +303,8 @@ def get_##Name##_v = get_##Name<T>::value;
 			bool has_component() { return ctx.ctx.has_component(slice.c->type, complist<T>); }
 			const entity* get_entities() { return ctx.ctx.get_entities(slice.c) + slice.start; }
 			const pass& ctx;
+			//buffer growth inside the task goes to the pipeline's resource
+			memory_scope scope;
 			int gid;
 			chunk_slice slice;
 			int indexInKernel;
@@ -418,7 +421,7 @@ def get_##Name##_v = get_##Name<T>::value;
 			struct cmd_allocate
 			{
 				size_t e;
-				entity_type type;
+				const interned_type* type;
 			};
 			struct cmd_instantiate
 			{
@@ -428,7 +431,7 @@ def get_##Name##_v = get_##Name<T>::value;
 			struct cmd_cast
 			{
 				size_t e;
-				type_diff diff;
+				const interned_diff* diff;
 			};
 			struct cmd_destroy
 			{
@@ -469,6 +472,7 @@ def get_##Name##_v = get_##Name<T>::value;
 			private:
 				command_buffer* global;
 				storage_t storage;
+				type_table types; //recorded types and diffs, merged by id
 				chunk_vector<entity> entities;
 				chunk_vector<cmd_allocate> allocates;
 				chunk_vector<cmd_instantiate> instantiates;
@@ -527,6 +531,7 @@ def get_##Name##_v = get_##Name<T>::value;
 
 			virtual void sync_all() const {}
 			ECS_API void sync_all_ro() const;
+			using world::make_scope;
 
 			template<class T>
 			std::shared_ptr<pass> create_pass(const filters& v, T paramList, gsl::span<shared_entry> sharedEntries = {});
@@ -560,6 +565,8 @@ def get_##Name##_v = get_##Name<T>::value;
 			using world::next;
 			using world::query;
 			ECS_API chunk_vector<chunk*> query(archetype* g, const chunk_filter& filter = {});
+			using world::each_archetype;
+			ECS_API chunk_range each_chunk(archetype* g, const chunk_filter& filter = {});
 			using world::get_archetypes;
 
 
@@ -601,10 +608,14 @@ def get_##Name##_v = get_##Name<T>::value;
 			ECS_API void patch_chunk(chunk* c, patcher_i* patcher);
 			//serialize
 			ECS_API void serialize(serializer_i* s);
-			ECS_API void deserialize(serializer_i* s);
+			ECS_API bool deserialize(serializer_i* s);
 			//clear
 			using world::gc_meta;
 			ECS_API void merge_chunks();
+			//waits only for passes on the archetype being compacted
+			using world::defragment;
+			//memory
+			ECS_API void reserve(uint32_t entityCount, const archetype_hint* hints = nullptr, uint32_t hintCount = 0, prefault_mode mode = prefault_mode::none);
 			//query
 			using world::get_timestamp;
 			using world::inc_timestamp;
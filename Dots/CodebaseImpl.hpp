@@ -27,15 +27,15 @@ namespace core
 			static_assert(hana::is_a<hana::tuple_tag>(paramList), "parameter list should be a hana::list");
 
 			auto paramCount = hana::length(paramList).value;
-			auto archs = query(v.archetypeFilter);
+			auto archs = each_archetype(v.archetypeFilter);
 			constexpr size_t bits = std::numeric_limits<uint32_t>::digits;
 			const auto bal = paramCount / bits + 1;
 			
 			size_t bufferSize =
 				sizeof(pass) //自己
 				+ v.get_size()
-				+ archs.size * (sizeof(void*) + sizeof(mask)) // mask + archetype
-				+ paramCount * sizeof(type_index) * (archs.size + 1) //type + local type list
+				+ archs.size() * (sizeof(void*) + sizeof(mask)) // mask + archetype
+				+ paramCount * sizeof(type_index) * (archs.size() + 1) //type + local type list
 				+ bal * sizeof(type_index) * 2; //readonly + random access
 			char* buffer = (char*)::malloc(bufferSize);
 			pass* k = new(buffer) pass{ *this };
@@ -43,16 +43,16 @@ namespace core
 			std::shared_ptr<pass> ret{ k, deleter };
 			buffer += sizeof(pass);
 			k->passIndex = passIndex++;
-			k->archetypeCount = (int)archs.size;
+			k->archetypeCount = (int)archs.size();
 			k->paramCount = (int)paramCount;
-			k->archetypes = allocate_inplace<archetype*>(buffer, archs.size);
-			k->matched = allocate_inplace<mask>(buffer, archs.size);
+			k->archetypes = allocate_inplace<archetype*>(buffer, archs.size());
+			k->matched = allocate_inplace<mask>(buffer, archs.size());
 			k->types = allocate_inplace<type_index>(buffer, paramCount);
 			k->readonly = allocate_inplace<uint32_t>(buffer, bal);
 			k->randomAccess = allocate_inplace<uint32_t>(buffer, bal);
 			memset(k->readonly, 0, sizeof(uint32_t) * bal);
 			memset(k->randomAccess, 0, sizeof(uint32_t) * bal);
-			k->localType = allocate_inplace<uint32_t>(buffer, paramCount * archs.size);
+			k->localType = allocate_inplace<uint32_t>(buffer, paramCount * archs.size());
 			k->filter = v.clone(buffer);
 			k->hasRandomWrite = false;
 			int t = 0;
@@ -95,6 +95,10 @@ namespace core
 			using weak_ptr_set = std::set<std::weak_ptr<custom_pass>, weak_ptr_compare>;
 		}
 
+		template<class ...params>
+		inline operation<params...>::operation(hana::tuple<params...> ps, const pass& k, const task& t)
+			:ctx(k), scope(k.ctx.make_scope()), gid(t.gid), slice(t.slice), indexInKernel(t.indexInKernel) {}
+
 		template<class ...params>
 		template<class T>
 		inline constexpr auto operation<params...>::param_id()
@@ -3,11 +3,9 @@
 #include <map>
 #include <mutex>
 #include <thread>
+#include <numeric>
 #define cat(a, b) a##b
 #define forloop(i, z, n) for(auto i = std::decay_t<decltype(n)>(z); i<(n); ++i)
-#define AO(type, name, size) \
-adaptive_object _ao_##name{(size)*sizeof(type)}; \
-type* name = (type*)_ao_##name.self;
 
 using namespace core;
 using namespace database;
@@ -44,68 +42,23 @@ builtin_id core::database::get_builtin()
 }
 
 #define stack_array(type, name, size) \
-stack_object __so_##name((size_t)(size)*sizeof(type)); \
+scratch_object __so_##name((size_t)(size)*sizeof(type)); \
 type* name = (type*)__so_##name.self;
 
-struct stack_object
+//bump allocated from thread scratch, released when the scope exits
+struct scratch_object
 {
-	size_t size;
+	scratch_arena& arena;
+	scratch_arena::marker m;
 	void* self;
-	stack_object(size_t size)
-		: size(size), self(nullptr)
+	scratch_object(size_t size)
+		: arena(context::scratch()), m(arena.mark())
 	{
-		self = DotsContext->stack_alloc(size);
+		self = arena.alloc(size);
 	}
-	~stack_object()
+	~scratch_object()
 	{
-		DotsContext->stack_free(self, size);
-	}
-};
-
-struct adaptive_object
-{
-	enum
-	{
-		Pool,
-		Heap,
-		Stack,
-	} type;
-
-	size_t size;
-	void* self;
-	adaptive_object(size_t size)
-		:size(size), self(nullptr)
-	{
-		if (DotsContext->stack.stackSize - size > 1024)
-		{
-			self = DotsContext->stack_alloc(size);
-			type = Stack;
-		}
-		else if (size < kFastBinCapacity)
-		{
-			self = DotsContext->malloc(alloc_type::fastbin);
-			type = Pool;
-		}
-		else
-		{
-			self = ::malloc(size);
-			type = Heap;
-		}
-	}
-	~adaptive_object()
-	{
-		switch (type)
-		{
-		case Pool:
-			DotsContext->free(alloc_type::fastbin, self);
-			break;
-		case Heap:
-			::free(self);
-			break;
-		case Stack:
-			DotsContext->stack_free(self, size);
-			break;
-		}
+		arena.rewind(m);
 	}
 };
 
@@ -137,27 +90,6 @@ void copy(char* dst, const char* src, archetype* type, tsize_t t, size_t count)
 }
 
 
-void chunk::link(chunk* c) noexcept
-{
-	if (c != nullptr)
-	{
-		c->next = next;
-		c->prev = this;
-	}
-	if (next != nullptr)
-		next->prev = c;
-	next = c;
-}
-
-void chunk::unlink() noexcept
-{
-	if (prev != nullptr)
-		prev->next = next;
-	if (next != nullptr)
-		next->prev = prev;
-	prev = next = nullptr;
-}
-
 void chunk::clone(chunk* dst) noexcept
 {
 	memcpy(dst, this, get_size());
@@ -177,7 +109,7 @@ void chunk::clone(chunk* dst) noexcept
 			buffer* b = (buffer*)((size_t)j * sizes[i] + src);
 			if (b->d != nullptr)
 			{
-				char* clonedData = (char*)buffer_malloc(b->size);
+				char* clonedData = (char*)buffer_malloc(b->capacity);
 				memcpy(clonedData, b->d, b->size);
 				b->d = clonedData;
 			}
@@ -207,17 +139,58 @@ void chunk::move(chunk_slice dst, tsize_t srcIndex) noexcept
 
 void chunk::move(chunk_slice dst, const chunk* src, uint32_t srcIndex) noexcept
 {
-	//assert(dst.c->type == src->type)
+	//assert(dst.c->type == src->type), bins may differ
 	uint32_t* offsets = dst.c->type->offsets[(int)dst.c->ct];
+	uint32_t* srcOffsets = src->type->offsets[(int)src->ct];
 	uint16_t* sizes = dst.c->type->sizes;
 	forloop(i, 0, dst.c->type->firstTag)
 		memcpy(
 			dst.c->data() + offsets[i] + (size_t)sizes[i] * dst.start,
-			src->data() + offsets[i] + (size_t)sizes[i] * srcIndex,
+			src->data() + srcOffsets[i] + (size_t)sizes[i] * srcIndex,
 			(size_t)dst.count * sizes[i]
 		);
 }
 
+void chunk::relayout(chunk_slice dst, chunk* src, uint32_t srcIndex) noexcept
+{
+	//same types, only inline size of adaptive buffers differs
+	archetype* srcType = src->type;
+	archetype* dstType = dst.c->type;
+	uint32_t* srcOffsets = srcType->offsets[(int)src->ct];
+	uint32_t* dstOffsets = dstType->offsets[(int)dst.c->ct];
+	uint16_t* srcSizes = srcType->sizes;
+	uint16_t* dstSizes = dstType->sizes;
+	forloop(i, 0, dstType->firstTag)
+	{
+		char* s = src->data() + srcOffsets[i] + (size_t)srcSizes[i] * srcIndex;
+		char* d = dst.c->data() + dstOffsets[i] + (size_t)dstSizes[i] * dst.start;
+		if (srcSizes[i] == dstSizes[i])
+		{
+			memcpy(d, s, (size_t)dstSizes[i] * dst.count);
+			continue;
+		}
+		uint32_t inlineSize = static_cast<uint32_t>(dstSizes[i] - sizeof(buffer));
+		forloop(j, 0, dst.count)
+		{
+			buffer* sb = (buffer*)(s + (size_t)j * srcSizes[i]);
+			buffer* db = new(d + (size_t)j * dstSizes[i]) buffer{ inlineSize };
+			if (sb->d != nullptr && sb->size > inlineSize)
+			{
+				//still spilled, keep overflow storage
+				db->d = sb->d;
+				db->size = sb->size;
+				db->capacity = sb->capacity;
+			}
+			else
+			{
+				db->push(sb->data(), sb->size);
+				if (sb->d != nullptr)
+					buffer_free(sb->d);
+			}
+		}
+	}
+}
+
 #define srcData (s.c->data() + (size_t)offsets[i] + (size_t)sizes[i] * s.start)
 void chunk::construct(chunk_slice s) noexcept
 {
@@ -233,7 +206,7 @@ void chunk::construct(chunk_slice s) noexcept
 		char* src = srcData;
 		forloop(j, 0, s.count)
 			new((size_t)j * sizes[i] + src) buffer{ 
-				static_cast<uint16_t>( static_cast<size_t>(sizes[i]) - sizeof(buffer) )
+				static_cast<uint32_t>( static_cast<size_t>(sizes[i]) - sizeof(buffer) )
 			};
 	}
 	forloop(i, type->firstManaged, type->firstTag)
@@ -291,7 +264,8 @@ type_index to_valid_type(type_index t)
 }
 
 #undef srcData
-#define dstData (dst.c->data() + offsets[i] + (size_t)sizes[i] * dst.start)
+//dst may live in a chunk of another size class, index columns by dst layout
+#define dstData (dst.c->data() + dstOffsets[dstI] + (size_t)sizes[i] * dst.start)
 #define srcData (src->data() + offsets[i] + (size_t)sizes[i] * srcIndex)
 void chunk::duplicate(chunk_slice dst, const chunk* src, tsize_t srcIndex) noexcept
 {
@@ -322,13 +296,6 @@ void chunk::duplicate(chunk_slice dst, const chunk* src, tsize_t srcIndex) noexc
 		dstI++;
 	}
 
-	forloop(i, type->firstManaged, type->firstTag)
-	{
-		const char* s = srcData;
-		char* d = dstData;
-		forloop(j, 0, dst.count)
-			::copy(d + sizes[i] * j, s, type, i, 1);
-	}
 	forloop(i, type->firstBuffer, type->firstManaged)
 	{
 		type_index st = to_valid_type(type->types[i]);
@@ -344,13 +311,26 @@ void chunk::duplicate(chunk_slice dst, const chunk* src, tsize_t srcIndex) noexc
 			buffer* b = (buffer*)((size_t)j * sizes[i] + d);
 			if (b->d != nullptr)
 			{
-				char* clonedData = (char*)buffer_malloc(b->size);
+				char* clonedData = (char*)buffer_malloc(b->capacity);
 				memcpy(clonedData, b->d, b->size);
 				b->d = clonedData;
 			}
 		}
 		dstI++;
 	}
+	forloop(i, type->firstManaged, type->firstTag)
+	{
+		type_index st = to_valid_type(type->types[i]);
+		type_index dt = to_valid_type(dstType->types[dstI]);
+
+		if (st != dt)
+			continue;
+		const char* s = srcData;
+		char* d = dstData;
+		forloop(j, 0, dst.count)
+			::copy(d + sizes[i] * j, s, type, i, 1);
+		dstI++;
+	}
 }
 
 //todo: will compiler inline patcher?
@@ -402,7 +382,7 @@ void chunk::patch(chunk_slice s, patcher_i* patcher) noexcept
 			forloop(j, 0, s.count)
 			{
 				buffer* b = (buffer*)(arr + (size_t)sizes[i] * j);
-				uint16_t n = b->size / t.elementSize;
+				uint32_t n = b->size / t.elementSize;
 				auto f = t.vtable.patch;
 				if (f != nullptr)
 				{
@@ -466,12 +446,18 @@ void chunk::serialize(chunk_slice s, serializer_i* stream, bool withEntities)
 	if(withEntities)
 		archive(stream, s.c->get_entities() + s.start, s.count);
 
-	forloop(i, 0, type->firstTag)
+	forloop(i, 0, type->firstBuffer)
+	{
+		char* arr = s.c->data() + offsets[i] + (size_t)sizes[i] * s.start;
+		archive(stream, arr, sizes[i] * s.count);
+	}
+	forloop(i, type->firstManaged, type->firstTag)
 	{
 		char* arr = s.c->data() + offsets[i] + (size_t)sizes[i] * s.start;
 		archive(stream, arr, sizes[i] * s.count);
 	}
 	
+	//buffers are streamed by content, inline size of adaptive buffers may differ between worlds
 	if (stream->is_serialize())
 	{
 		forloop(i, type->firstBuffer, type->firstManaged)
@@ -480,6 +466,7 @@ void chunk::serialize(chunk_slice s, serializer_i* stream, bool withEntities)
 			forloop(j, 0, s.count)
 			{
 				buffer* b = (buffer*)(arr + (size_t)j * sizes[i]);
+				archive(stream, b->size);
 				archive(stream, b->data(), b->size);
 			}
 		}
@@ -491,9 +478,14 @@ void chunk::serialize(chunk_slice s, serializer_i* stream, bool withEntities)
 			char* arr = s.c->data() + offsets[i] + (size_t)sizes[i] * s.start;
 			forloop(j, 0, s.count)
 			{
-				buffer* b = (buffer*)(arr + (size_t)j * sizes[i]);
-				if (b->d != nullptr)
-					b->d = (char*)malloc(b->capacity);
+				buffer* b = new(arr + (size_t)j * sizes[i]) buffer{
+					static_cast<uint32_t>(static_cast<size_t>(sizes[i]) - sizeof(buffer))
+				};
+				uint32_t size = 0;
+				archive(stream, size);
+				if (size > b->capacity)
+					b->grow(size);
+				b->size = size;
 				archive(stream, b->data(), b->size);
 			}
 		}
@@ -502,190 +494,257 @@ void chunk::serialize(chunk_slice s, serializer_i* stream, bool withEntities)
 
 size_t chunk::get_size()
 {
-	switch (ct)
-	{
-	case alloc_type::fastbin:
-		return kFastBinSize;
-	case alloc_type::smallbin:
-		return kSmallBinSize;
-	case alloc_type::largebin:
-		return kLargeBinSize;
-	}
-	return 0;
+	return DotsContext->get_bin_size(ct);
 }
 
-void chunk::cast(chunk_slice dst, chunk* src, tsize_t srcIndex, bool destruct) noexcept
+void chunk::cast(chunk_slice dst, chunk* src, tsize_t srcIndex, const cast_plan* plan, bool destruct) noexcept
 {
 	archetype* srcType = src->type;
 	archetype* dstType = dst.c->type;
-	tsize_t dstI = 0;
-	tsize_t srcI = 0;
 	uint32_t count = dst.count;
 	uint32_t* srcOffsets = srcType->offsets[(int)src->ct];
 	uint32_t* dstOffsets = dstType->offsets[(int)dst.c->ct];
-	uint16_t* srcSizes = srcType->sizes;
-	uint16_t* dstSizes = dstType->sizes;
-	type_index* srcTypes = srcType->types; type_index* dstTypes = dstType->types;
-
-	//phase0: cast all components
-	while (srcI < srcType->firstBuffer && dstI < dstType->firstBuffer)
-	{
-		auto st = to_valid_type(srcTypes[srcI]);
-		auto dt = to_valid_type(dstTypes[dstI]);
-		char* s = src->data() + srcOffsets[srcI] + srcSizes[srcI] * srcIndex;
-		char* d = dst.c->data() + dstOffsets[dstI] + dstSizes[dstI] * dst.start;
-		if (st < dt) //destruct 
-			srcI++;
-		else if (st > dt) //construct
-#ifndef NOINITIALIZE
-			memset(d, 0, (size_t)dstSizes[dstI++] * count);
-#else
-			dstI++;
-#endif
-		else //move
-			memcpy(d, s, (size_t)dstSizes[(srcI++, dstI++)] * count);
-	}
-
-	srcI = srcType->firstBuffer; // destruct
-#ifndef NOINITIALIZE
-	while (dstI < dstType->firstBuffer) //construct
-	{
-		char* d = dst.c->data() + dstOffsets[dstI] + (size_t)dstSizes[dstI] * dst.start;
-		memset(d, 0, (size_t)dstSizes[dstI] * count);
-		dstI++;
-	}
-#else
-	dstI = dstType->firstBuffer;
-#endif
+	auto srcColumn = [&](tsize_t i, size_t size) { return src->data() + srcOffsets[i] + size * srcIndex; };
+	auto dstColumn = [&](tsize_t i, size_t size) { return dst.c->data() + dstOffsets[i] + size * dst.start; };
 
-
-	//phase1: cast all buffers
-	while (srcI < srcType->firstManaged && dstI < dstType->firstManaged)
+	//columns are independent, ops keep the order of pod, buffer, managed
+	const cast_plan::op* ops = plan->ops();
+	forloop(k, 0, plan->opCount)
 	{
-		auto st = to_valid_type(srcTypes[srcI]);
-		auto dt = to_valid_type(dstTypes[dstI]);
-		char* s = src->data() + srcOffsets[srcI] + (size_t)srcSizes[srcI] * srcIndex;
-		char* d = dst.c->data() + dstOffsets[dstI] + (size_t)dstSizes[dstI] * dst.start;
-		if (st < dt) //destruct 
+		const auto& op = ops[k];
+		switch (op.type)
 		{
-			if (destruct)
-				forloop(j, 0, count)
-				((buffer*)((size_t)j * srcSizes[srcI] + s))->~buffer();
-			srcI++;
-		}
-		else if (st > dt) //construct
+		case cast_plan::op_none:
+			break;
+		case cast_plan::op_copy:
+			memcpy(dstColumn(op.dstI, op.size), srcColumn(op.srcI, op.size), (size_t)op.size * count);
+			break;
+		case cast_plan::op_zero:
+			memset(dstColumn(op.dstI, op.size), 0, (size_t)op.size * count);
+			break;
+		case cast_plan::op_construct_buffer:
 		{
+			char* d = dstColumn(op.dstI, op.size);
 			forloop(j, 0, count)
-				new((size_t)j * dstSizes[dstI] + d) buffer{ 
-					static_cast<uint16_t>( static_cast<size_t>(dstSizes[dstI]) - sizeof(buffer) )
-				};
-			dstI++;
-		}
-		else //move
-		{
-			memcpy(d, s, (size_t)dstSizes[dstI] * count);
-			dstI++; srcI++;
+				new((size_t)j * op.size + d) buffer{ static_cast<uint32_t>(op.size - sizeof(buffer)) };
+			break;
 		}
-	}
-
-	if (destruct)
-		while (srcI < srcType->firstManaged) //destruct 
+		case cast_plan::op_destruct_buffer:
 		{
-			char* s = src->data() + srcOffsets[srcI] + (size_t)srcSizes[srcI] * srcIndex;
+			if (!destruct)
+				break;
+			char* s = srcColumn(op.srcI, op.size);
 			forloop(j, 0, count)
-				((buffer*)((size_t)j * srcSizes[srcI] + s))->~buffer();
-			srcI++;
+				((buffer*)((size_t)j * op.size + s))->~buffer();
+			break;
+		}
+		case cast_plan::op_construct:
+			::construct(dstColumn(op.dstI, op.size), dstType, op.dstI, count);
+			break;
+		case cast_plan::op_destruct:
+			if (destruct)
+				::destruct(srcColumn(op.srcI, op.size), srcType, op.srcI, count);
+			break;
 		}
-	else
-		srcI = srcType->firstManaged;
-	while (dstI < dstType->firstManaged) //construct
-	{
-		char* d = dst.c->data() + dstOffsets[dstI] + (size_t)dstSizes[dstI] * dst.start;
-		forloop(j, 0, count)
-			new((size_t)j * dstSizes[dstI] + d) buffer{ 
-				static_cast<uint16_t>( static_cast<size_t>(dstSizes[dstI]) - sizeof(buffer) )
-			};
-		dstI++;
 	}
 
-	//phase2: cast all managed
-	while (srcI < srcType->firstTag && dstI < dstType->firstTag)
+	//maintain mask for new archetype
+	if (plan->dstMaskId != InvalidIndex)
 	{
-		auto st = to_valid_type(srcTypes[srcI]);
-		auto dt = to_valid_type(dstTypes[dstI]);
-		char* s = src->data() + srcOffsets[srcI] + srcSizes[srcI] * srcIndex;
-		char* d = dst.c->data() + dstOffsets[dstI] + dstSizes[dstI] * dst.start;
-		if (st < dt) //destruct 
-		{
-			::destruct(s, srcType, srcI, count);
-			srcI++;
-		}
-		else if (st > dt) //construct
+		mask* d = (mask*)dstColumn(plan->dstMaskId, sizeof(mask));
+		const cast_plan::bit_remap* remaps = plan->remaps();
+		if (plan->remapCount == 0)
+			std::fill(d, d + count, plan->newBits);
+		else
 		{
-			::construct(d, dstType, dstI, count);
-			dstI++;
+			const mask* s = (const mask*)srcColumn(plan->srcMaskId, sizeof(mask));
+			forloop(i, 0, count)
+			{
+				mask m = plan->newBits;
+				forloop(j, 0, plan->remapCount)
+					if (s[i].test(remaps[j].src))
+						m.set(remaps[j].dst);
+				d[i] = m;
+			}
 		}
-		else //move
-			memcpy(d, s, (size_t)dstSizes[(srcI++, dstI++)] * count);
 	}
+}
+
+cast_plan* cast_plan::build(archetype* srcType, archetype* dstType)
+{
+	//at most one op per column of either side, one remap per dst component
+	tsize_t maxOps = srcType->firstTag + dstType->firstTag;
+	tsize_t maxRemaps = dstType->componentCount;
+	cast_plan* plan = (cast_plan*)::malloc(sizeof(cast_plan) + sizeof(op) * maxOps + sizeof(bit_remap) * maxRemaps);
+	plan->dst = dstType;
+	plan->opCount = 0;
+	plan->remapCount = 0;
+	plan->remapOffset = maxOps;
+	op* ops = plan->ops();
+	type_index* srcTypes = srcType->types;
+	type_index* dstTypes = dstType->types;
+	uint16_t* sizes = dstType->sizes;
+	uint16_t* srcSizes = srcType->sizes;
 
-	while(srcI < srcType->firstTag) // destruct
+	//merge two sorted ranges, visit(srcI, dstI) with InvalidIndex for missing side
+	auto merge = [&](tsize_t srcI, tsize_t srcEnd, tsize_t dstI, tsize_t dstEnd, auto&& visit)
 	{
-		char* s = src->data() + srcOffsets[srcI] + srcSizes[srcI] * srcIndex;
-		::destruct(s, srcType, srcI, count);
-		srcI++;
-	}
-	while (dstI < dstType->firstTag) //construct
+		while (srcI < srcEnd || dstI < dstEnd)
+		{
+			if (dstI == dstEnd || (srcI < srcEnd && to_valid_type(srcTypes[srcI]) < to_valid_type(dstTypes[dstI])))
+				visit(srcI++, InvalidIndex);
+			else if (srcI == srcEnd || to_valid_type(srcTypes[srcI]) > to_valid_type(dstTypes[dstI]))
+				visit(InvalidIndex, dstI++);
+			else
+				visit(srcI++, dstI++);
+		}
+	};
+	auto phase = [&](tsize_t srcBegin, tsize_t srcEnd, tsize_t dstBegin, tsize_t dstEnd, op_type construct, op_type destruct)
 	{
-		char* d = dst.c->data() + dstOffsets[dstI] + (size_t)dstSizes[dstI] * dst.start;
-		::construct(d, dstType, dstI, count);
-		dstI++;
-	}
+		merge(srcBegin, srcEnd, dstBegin, dstEnd, [&](tsize_t srcI, tsize_t dstI)
+			{
+				if (srcI == InvalidIndex)
+				{
+					if (construct != op_none)
+						ops[plan->opCount++] = { construct, srcI, dstI, sizes[dstI] };
+				}
+				else if (dstI == InvalidIndex)
+				{
+					if (destruct != op_none)
+						ops[plan->opCount++] = { destruct, srcI, dstI, srcSizes[srcI] };
+				}
+				else
+					ops[plan->opCount++] = { op_copy, srcI, dstI, sizes[dstI] };
+			});
+	};
+#ifndef NOINITIALIZE
+	phase(0, srcType->firstBuffer, 0, dstType->firstBuffer, op_zero, op_none);
+#else
+	phase(0, srcType->firstBuffer, 0, dstType->firstBuffer, op_none, op_none);
+#endif
+	phase(srcType->firstBuffer, srcType->firstManaged, dstType->firstBuffer, dstType->firstManaged, op_construct_buffer, op_destruct_buffer);
+	phase(srcType->firstManaged, srcType->firstTag, dstType->firstManaged, dstType->firstTag, op_construct, op_destruct);
 
-	//phase3: maintain mask for new archetype
-	tsize_t srcMaskId = srcType->index(mask_id);
-	tsize_t dstMaskId = dstType->index(mask_id);
-	if (srcMaskId != InvalidIndex && dstMaskId != InvalidIndex)
+	//mask bits follow component index, new components start enabled
+	plan->srcMaskId = srcType->index(mask_id);
+	plan->dstMaskId = dstType->index(mask_id);
+	plan->newBits.reset();
+	if (plan->dstMaskId != InvalidIndex)
 	{
-		mask* s = (mask*)(src->data() + srcOffsets[srcMaskId] + (size_t)srcSizes[srcMaskId] * srcIndex);
-		mask* d = (mask*)(dst.c->data() + dstOffsets[dstMaskId] + (size_t)dstSizes[dstMaskId] * dst.start);
-		forloop(i, 0, count)
+		if (plan->srcMaskId == InvalidIndex)
+			plan->newBits.set();
+		else
 		{
-			srcI = dstI = 0;
-			d[i].reset();
-			while (srcI < srcType->componentCount && dstI < dstType->componentCount)
-			{
-				auto st = to_valid_type(srcTypes[srcI]);
-				auto dt = to_valid_type(dstTypes[dstI]);
-				if (st < dt) //destruct 
-					;
-				else if (st > dt) //construct
-					d[i].set(dstI);
-				else //move
-					if (s[i].test(srcI))
-						d[i].set(dstI);
-			}
-			while (dstI < dstType->componentCount)
-				d[i].set(dstI);
+			bit_remap* remaps = plan->remaps();
+			merge(0, srcType->componentCount, 0, dstType->componentCount, [&](tsize_t srcI, tsize_t dstI)
+				{
+					if (dstI == InvalidIndex || dstI >= plan->newBits.size())
+						return;
+					if (srcI == InvalidIndex)
+						plan->newBits.set(dstI);
+					else if (srcI < plan->newBits.size())
+						remaps[plan->remapCount++] = { srcI, dstI };
+				});
 		}
 	}
-	else if (dstMaskId != InvalidIndex)
-	{
-		mask* d = (mask*)(dst.c->data() + dstOffsets[dstMaskId] + (size_t)dstSizes[dstMaskId] * dst.start);
-		memset(d, -1, (size_t)dstSizes[dstMaskId] * count);
-	}
+	return plan;
+}
+
+type_table::~type_table()
+{
+	clear();
+}
+
+char* type_table::get_scratch(size_t size)
+{
+	if (scratch.size() < size)
+		scratch.resize(size);
+	return scratch.data();
+}
+
+const interned_type* type_table::intern(const entity_type& type)
+{
+	auto iter = types.find(type);
+	if (iter != types.end())
+		return iter->second;
+	interned_type* it = (interned_type*)::malloc(sizeof(interned_type) + type.get_size());
+	char* buffer = (char*)(it + 1);
+	it->type = type.clone(buffer);
+	it->hash = entity_type::hash{}(it->type);
+	it->id = (uint32_t)typeList.size();
+	typeList.push_back(it);
+	types.insert({ it->type, it });
+	return it;
+}
+
+const interned_diff* type_table::intern(const type_diff& diff)
+{
+	auto extend = intern(diff.extend);
+	auto shrink = intern(diff.shrink);
+	uint64_t key = (uint64_t)extend->id << 32 | shrink->id;
+	auto iter = diffs.find(key);
+	if (iter != diffs.end())
+		return iter->second;
+	interned_diff* d = new interned_diff{ extend, shrink, (uint32_t)diffList.size() };
+	diffList.push_back(d);
+	diffs.insert({ key, d });
+	return d;
+}
+
+const interned_type* type_table::apply(const interned_type* type, const interned_diff* diff)
+{
+	uint64_t key = (uint64_t)type->id << 32 | diff->id;
+	auto iter = applied.find(key);
+	if (iter != applied.end())
+		return iter->second;
+	char* buffer = get_scratch(type->type.get_size() * 2 + diff->extend->type.get_size());
+	auto shrinked = entity_type::substract(type->type, diff->shrink->type, buffer);
+	buffer += shrinked.get_size();
+	auto result = intern(entity_type::merge(shrinked, diff->extend->type, buffer));
+	applied.insert({ key, result });
+	return result;
+}
+
+const interned_diff* type_table::merge(const interned_diff* a, const interned_diff* b)
+{
+	uint64_t key = (uint64_t)a->id << 32 | b->id;
+	auto iter = merged.find(key);
+	if (iter != merged.end())
+		return iter->second;
+	char* buffer = get_scratch(a->get().get_size() + b->get().get_size());
+	auto result = intern(type_diff::merge(a->get(), b->get(), buffer));
+	merged.insert({ key, result });
+	return result;
+}
+
+void type_table::clear()
+{
+	for (auto t : typeList)
+		::free(t);
+	for (auto d : diffList)
+		delete d;
+	types.clear();
+	typeList.clear();
+	diffs.clear();
+	diffList.clear();
+	applied.clear();
+	merged.clear();
 }
 
 uint32_t* archetype::timestamps(chunk* c) const noexcept { return (uint32_t*)((char*)c + c->get_size()) - firstTag; }
 
-tsize_t archetype::index(type_index type) const noexcept
+void archetype::build_lookup() noexcept
 {
-	type_index* ts = types;
-	type_index* result = std::lower_bound(ts, ts + componentCount, type);
-	if (result != ts + componentCount && *result == type)
-		return tsize_t(result - ts);
-	else
-		return tsize_t(-1);
+	const uint32_t bits = lookup_bits(componentCount);
+	const uint32_t slotMask = (1u << bits) - 1;
+	std::fill(lookup, lookup + (1u << bits), tsize_t(-1));
+	forloop(i, 0, componentCount)
+	{
+		uint32_t h = lookup_hash(types[i], bits);
+		while (lookup[h] != tsize_t(-1))
+			h = (h + 1) & slotMask;
+		lookup[h] = i;
+	}
 }
 
 mask archetype::get_mask(const typeset& subtype) noexcept
@@ -733,19 +792,21 @@ size_t archetype::get_size()
 		sizeof(uint32_t) * firstTag * 3 + // offsets
 		sizeof(uint32_t) * firstTag + // sizes
 		sizeof(entity) * metaCount +  // metatypes
-		sizeof(managed_func) * (firstTag - firstManaged); //managedFuncs
+		sizeof(managed_func) * (firstTag - firstManaged) + //managedFuncs
+		(sizeof(tsize_t) << lookup_bits(componentCount)); //lookup
 }
 
 world::query_cache& world::get_query_cache(const archetype_filter& f) const
 {
-	auto iter = queries.find(f);
+	query_key key{ f };
+	auto iter = queries.find(key);
 	if (iter != queries.end())
 	{
-		return iter->second;
+		return *iter->second;
 	}
 	else
 	{
-		query_cache cache;
+		auto cache = std::make_unique<query_cache>();
 		bool includeClean = false;
 		bool includeDisabled = false;
 		bool includeCopy = [&]
@@ -780,37 +841,131 @@ world::query_cache& world::get_query_cache(const archetype_filter& f) const
 			typeset type{ _type, 0 };
 			typeset buffer{ _buffer ,0 };
 			get_shared_type(type, g, buffer);
+			type_signature sharedSig;
+			sharedSig.add(type);
 
-			return f.match(g->get_type(), type);
+			return match_query(*cache, g, type, sharedSig);
 		};
+		cache->includeClean = includeClean;
+		cache->includeDisabled = includeDisabled;
+		auto totalSize = f.get_size();
+		cache->data.reset(new char[totalSize]);
+		char* data = cache->data.get();
+		cache->filter = f.clone(data);
+		sign_query(cache.get());
 		for (auto i : archetypes)
 		{
 			auto g = i.second;
 			if (valid_group(g))
-			{
-				auto type = g->get_type();
-				auto cc = f.all.types.length + f.any.types.length;
-				stack_array(type_index, cd, cc);
-				auto checking = typeset::merge(f.all.types, f.any.types, cd);
-				mask m = g->get_mask(checking);
-				cache.archetypes.push_back({ g, m });
-			}
+				add_to_query(cache.get(), g);
 		}
-		cache.includeClean = includeClean;
-		cache.includeDisabled = includeDisabled;
-		auto totalSize = f.get_size();
-		cache.data.reset(new char[totalSize]);
-		char* data = cache.data.get();
-		cache.filter = f.clone(data);
-		queries[cache.filter] = std::move(cache);
-		return queries[cache.filter];
+		index_query(cache.get());
+		memory.queryBytes += sizeof(queries_t::value_type) + sizeof(query_cache) + totalSize;
+		query_key owned{ cache->filter, key.hash };
+		return *queries.emplace(owned, std::move(cache)).first->second;
+	}
+}
+
+void world::sign_query(query_cache* cache)
+{
+	auto& f = cache->filter;
+	cache->all.add(f.all.types);
+	cache->any.add(f.any.types);
+	cache->owned.add(f.owned);
+	cache->shared.add(f.shared);
+	stack_array(type_index, _nonOwned, f.none.types.length);
+	stack_array(type_index, _nonShared, f.none.types.length);
+	cache->noneOwned.add(typeset::substract(f.none.types, f.shared, _nonOwned));
+	cache->noneShared.add(typeset::substract(f.none.types, f.owned, _nonShared));
+	cache->overflow = cache->all.overflow || cache->any.overflow || cache->owned.overflow ||
+		cache->shared.overflow || cache->noneOwned.overflow || cache->noneShared.overflow;
+}
+
+//same as archetype_filter::match, with bitsets when every type id fits
+bool world::match_query(const query_cache& cache, archetype* g, const typeset& sharedT, const type_signature& sharedSig)
+{
+	auto& f = cache.filter;
+	if (cache.overflow || g->signature.overflow || sharedSig.overflow)
+		return f.match(g->get_type(), sharedT);
+	const type_signature& ownedSig = g->signature;
+	auto components = ownedSig | sharedSig;
+	if (!components.all(cache.all))
+		return false;
+	if (f.any.types.length > 0 && !components.any(cache.any))
+		return false;
+	if (ownedSig.any(cache.noneOwned) || sharedSig.any(cache.noneShared))
+		return false;
+	if (!ownedSig.all(cache.owned) || !sharedSig.all(cache.shared))
+		return false;
+
+	metaset metatypes{ g->metatypes, g->metaCount };
+	if (!metatypes.all(f.all.metatypes))
+		return false;
+	if (f.any.metatypes.length > 0 && !metatypes.any(f.any.metatypes))
+		return false;
+	if (metatypes.any(f.none.metatypes))
+		return false;
+	return true;
+}
+
+void world::index_query(query_cache* cache) const
+{
+	//any required component will do, archetypes without it can't match
+	auto& f = cache->filter;
+	if (f.all.types.length > 0)
+		queryIndex[f.all.types[0]].push_back(cache);
+	else if (f.owned.length > 0)
+		queryIndex[f.owned[0]].push_back(cache);
+	else if (f.shared.length > 0)
+		queryIndex[f.shared[0]].push_back(cache);
+	else if (f.any.types.length > 0)
+	{
+		forloop(i, 0, f.any.types.length)
+			queryIndex[f.any.types[i]].push_back(cache);
 	}
+	else
+		unanchoredQueries.push_back(cache);
+}
+
+void world::add_to_query(query_cache* cache, archetype* g) const
+{
+	auto& f = cache->filter;
+	auto cc = f.all.types.length + f.any.types.length;
+	stack_array(type_index, cd, cc);
+	auto checking = typeset::merge(f.all.types, f.any.types, cd);
+	archetypeQueries[g].push_back({ cache, (uint32_t)cache->archetypes.size() });
+	size_t capacity = cache->archetypes.capacity();
+	cache->archetypes.push_back({ g, g->get_mask(checking) });
+	memory.queryBytes += (cache->archetypes.capacity() - capacity) * sizeof(matched_archetype);
 }
 
 void world::update_queries(archetype* g, bool add)
 {
 	if(on_archetype_update)
 		on_archetype_update(g, add);
+	if (!add)
+	{
+		auto iter = archetypeQueries.find(g);
+		if (iter == archetypeQueries.end())
+			return;
+		for (auto& slot : iter->second)
+		{
+			auto& gs = slot.cache->archetypes;
+			if (slot.index != gs.size() - 1)
+			{
+				gs[slot.index] = gs.back();
+				for (auto& moved : archetypeQueries.find(gs.back().type)->second)
+					if (moved.cache == slot.cache)
+					{
+						moved.index = slot.index;
+						break;
+					}
+			}
+			gs.pop_back();
+		}
+		archetypeQueries.erase(g);
+		return;
+	}
 	tsize_t size = 0;
 	estimate_shared_size(size, g);
 	stack_array(type_index, _type, size);
@@ -818,44 +973,62 @@ void world::update_queries(archetype* g, bool add)
 	typeset type{ _type, 0 };
 	typeset buffer{ _buffer ,0 };
 	get_shared_type(type, g, buffer);
-	auto match_cache = [&](query_cache& cache)
-	{
-		if (cache.includeClean < g->cleaning)
-			return false;
-		if (cache.includeDisabled < g->disabled)
-			return false;
-		return cache.filter.match(g->get_type(), type);
+	auto gt = g->get_type();
+	stack_array(type_index, _components, gt.types.length + type.length);
+	auto components = typeset::merge(gt.types, type, _components);
+	type_signature sharedSig;
+	sharedSig.add(type);
+	auto visit = ++queryVisit;
+	auto match_cache = [&](query_cache* cache)
+	{
+		if (cache->visit == visit)
+			return;
+		cache->visit = visit;
+		if (cache->includeClean < g->cleaning)
+			return;
+		if (cache->includeDisabled < g->disabled)
+			return;
+		if (match_query(*cache, g, type, sharedSig))
+			add_to_query(cache, g);
 	};
-	for (auto& i : queries)
+	forloop(i, 0, components.length)
 	{
-		auto& cache = i.second;
-		if (match_cache(cache))
-		{
-			auto& gs = cache.archetypes;
-			if (!add)
-			{
-				int j = 0;
-				auto count = gs.size();
-				for (; j < count && gs[j].type != g; ++j);
-				if(j == count)
-					continue;
-				if (j != (count - 1))
-					std::swap(gs[j], gs[count - 1]);
-				gs.pop_back();
-			}
-			else
-				gs.push_back({ g });
-		}
+		auto iter = queryIndex.find(components[i]);
+		if (iter != queryIndex.end())
+			for (auto cache : iter->second)
+				match_cache(cache);
 	}
+	for (auto cache : unanchoredQueries)
+		match_cache(cache);
+}
+
+//0 for full chunks, 1 + bucket for chunks with free slots
+uint32_t occupancy_region(const archetype* g, const chunk* c)
+{
+	uint32_t capacity = g->chunkCapacity[(int)c->ct];
+	if (c->count >= capacity)
+		return 0;
+	return kOccupancyBuckets - (uint32_t)((uint64_t)c->count * kOccupancyBuckets / capacity);
 }
 
-void world::remove(chunk*& h, chunk*& t, chunk* c)
+uint32_t chunk_region(const archetype* g, uint32_t index)
 {
-	if (c == t)
-		t = t->prev;
-	if (h == c)
-		h = h->next;
-	c->unlink();
+	uint32_t r = 0;
+	while (r < kOccupancyBuckets && g->freeBuckets[r] <= index)
+		++r;
+	return r;
+}
+
+void world::swap_chunks(archetype* g, uint32_t a, uint32_t b)
+{
+	if (a == b)
+		return;
+	chunk* ca = g->chunks[a];
+	chunk* cb = g->chunks[b];
+	g->chunks[a] = cb;
+	cb->index = a;
+	g->chunks[b] = ca;
+	ca->index = b;
 }
 
 template<class T>
@@ -865,6 +1038,20 @@ void allocate_inline(T*& target, char*& buf, int count)
 	buf += count * sizeof(T);
 }
 
+//point inline arrays at the storage following g
+void bind_inline(archetype* g)
+{
+	char* buffer = (char*)(g + 1);
+	allocate_inline(g->types, buffer, g->componentCount);
+	allocate_inline(g->offsets[0], buffer, g->firstTag);
+	allocate_inline(g->offsets[1], buffer, g->firstTag);
+	allocate_inline(g->offsets[2], buffer, g->firstTag);
+	allocate_inline(g->sizes, buffer, g->firstTag);
+	allocate_inline(g->metatypes, buffer, g->metaCount);
+	allocate_inline(g->managedFuncs, buffer, g->firstTag - g->firstManaged);
+	allocate_inline(g->lookup, buffer, 1 << archetype::lookup_bits(g->componentCount));
+}
+
 archetype* world::get_archetype(const entity_type& key)
 {
 	auto iter = archetypes.find(key);
@@ -932,9 +1119,17 @@ archetype* world::construct_archetype(const entity_type& key)
 	proto.withTracked = false;
 	proto.zerosize = false;
 	proto.chunkCount = 0;
+	proto.chunkBytes = 0;
 	proto.size = 0;
 	proto.timestamp = timestamp;
-	proto.lastChunk = proto.firstChunk = proto.firstFree = nullptr;
+	proto.chunks = nullptr;
+	proto.chunkSlots = 0;
+	std::fill(proto.freeBuckets, proto.freeBuckets + kOccupancyBuckets, 0);
+	proto.edges = nullptr;
+	proto.plans = nullptr;
+	proto.edgesIn = nullptr;
+	proto.plansIn = nullptr;
+	proto.hash = entity_type::hash{}(key);
 
 	const type_index disableType = disable_id;
 	const type_index cleanupType = cleanup_id;
@@ -957,17 +1152,12 @@ archetype* world::construct_archetype(const entity_type& key)
 
 	//生成内敛数组
 	archetype* g = new(malloc(proto.get_size() + sizeof(archetype))) archetype(proto);
-	char* buffer = (char*)(g + 1);
-	allocate_inline(g->types, buffer, count);
-	allocate_inline(g->offsets[0], buffer, firstTag);
-	allocate_inline(g->offsets[1], buffer, firstTag);
-	allocate_inline(g->offsets[2], buffer, firstTag);
-	allocate_inline(g->sizes, buffer, firstTag);
-	allocate_inline(g->metatypes, buffer, metaCount);
-	allocate_inline(g->managedFuncs, buffer, firstTag - firstManaged);
+	bind_inline(g);
 	type_index* types = g->types;
 	entity* metatypes = g->metatypes;
 	memcpy(types, key.types.data, count * sizeof(type_index));
+	g->build_lookup();
+	g->signature.add(typeset{ types, count });
 	memcpy(metatypes, key.metatypes.data, key.metatypes.length * sizeof(entity));
 	uint16_t* sizes = g->sizes;
 
@@ -981,47 +1171,74 @@ archetype* world::construct_archetype(const entity_type& key)
 	stack_array(size_t, align, firstTag);
 	stack_array(core::GUID, hash, firstTag);
 	stack_array(tsize_t, stableOrder, firstTag);
+	size_t capacityStep = 1;
 	forloop(i, 0, firstTag)
 	{
 		auto type = (type_index)key.types[i];
 		auto& info = DotsContext->infos[type.index()];
-		sizes[i] = info.size;
+		sizes[i] = get_size(type);
 		hash[i] = info.GUID;
 		align[i] = info.alignment;
 		stableOrder[i] = i;
-		entitySize += info.size;
+		entitySize += sizes[i];
+		//raised column alignment, capacities are padded so the column stays a whole number of units
+		size_t columnAlign = std::min<size_t>(std::max(info.columnAlignment, DotsContext->columnAlignment), kChunkAlignment);
+		if (columnAlign > align[i])
+		{
+			align[i] = columnAlign;
+			capacityStep = std::max(capacityStep, columnAlign / std::gcd<size_t>(sizes[i], columnAlign));
+		}
 	}
 	if (entitySize == sizeof(entity))
 		g->zerosize = true;
 	g->entitySize = entitySize;
-	size_t Caps[] = { kSmallBinSize, kFastBinSize, kLargeBinSize };
+	size_t Caps[] = { DotsContext->get_bin_size(alloc_type::smallbin), DotsContext->get_bin_size(alloc_type::fastbin), DotsContext->get_bin_size(alloc_type::largebin) };
 	std::sort(stableOrder, stableOrder + firstTag, [&](tsize_t lhs, tsize_t rhs)
 		{
 			return hash[lhs] < hash[rhs];
 		});
-	forloop(i, 0, 3)
+	//columns are aligned relative to the chunk block, which is kChunkAlignment aligned
+	auto layout = [&](uint32_t capacity, uint32_t* offsets)
 	{
-		uint32_t* offsets = g->offsets[(int)(alloc_type)i];
-		g->chunkCapacity[i] = (uint32_t)(Caps[i] - sizeof(chunk) - sizeof(uint32_t) * firstTag) / entitySize;
-		if (g->chunkCapacity[i] == 0)
-			continue;
-		uint32_t offset = sizeof(entity) * g->chunkCapacity[i];
+		size_t offset = sizeof(chunk) + sizeof(entity) * capacity;
 		forloop(j, 0, firstTag)
 		{
 			tsize_t id = stableOrder[j];
-			offset = static_cast<uint32_t>(
-				align[id] * ((offset + align[id] - 1) / align[id]));
-			offsets[id] = offset;
-			offset += sizes[id] * g->chunkCapacity[i];
+			offset = align[id] * ((offset + align[id] - 1) / align[id]);
+			offsets[id] = static_cast<uint32_t>(offset - sizeof(chunk));
+			offset += (size_t)sizes[id] * capacity;
+		}
+		return offset - sizeof(chunk);
+	};
+	forloop(i, 0, 3)
+	{
+		uint32_t* offsets = g->offsets[(int)(alloc_type)i];
+		size_t reserved = sizeof(chunk) + sizeof(uint32_t) * firstTag;
+		size_t avail = Caps[i] > reserved ? Caps[i] - reserved : 0;
+		uint32_t capacity = (uint32_t)(avail / entitySize);
+		if (capacity >= capacityStep)
+			capacity = capacity / capacityStep * capacityStep;
+		//alignment padding may push the last column over the end
+		size_t used = capacity > 0 ? layout(capacity, offsets) : 0;
+		while (capacity > 0 && used > avail)
+		{
+			capacity -= capacity >= capacityStep ? (uint32_t)capacityStep : 1u;
+			used = capacity > 0 ? layout(capacity, offsets) : 0;
 		}
+		g->chunkCapacity[i] = capacity;
+		g->chunkPadding[i] = (uint32_t)(used - (size_t)capacity * entitySize);
+		g->chunkSlack[i] = (uint32_t)(avail - used);
 	}
+	//wide archetypes skip chunks holding only a handful of entities
+	g->chunkClass = g->chunkCapacity[(int)alloc_type::smallbin] >= kMinChunkEntities ? alloc_type::smallbin : alloc_type::fastbin;
+	g->grown = 0;
 	return g;
 }
 
 void world::add_archetype(archetype* g)
 {
 	update_queries(g, true);
-	archetypes.insert({ g->get_type(), g });
+	archetypes.insert({ { g->get_type(), g->hash }, g });
 }
 
 archetype* world::get_cleaning(archetype* g)
@@ -1061,11 +1278,84 @@ bool world::is_cleaned(const entity_type& type)
 	return type.types.length == 1;
 }
 
+//transitions are in two intrusive lists, prev points at the link pointing to the node
+template<class T>
+void link_transition(T*& head, T** headIn, T* node)
+{
+	node->next = head;
+	node->prev = &head;
+	if (head != nullptr)
+		head->prev = &node->next;
+	head = node;
+	//failed transitions have no destination to link into
+	if (headIn == nullptr)
+	{
+		node->nextIn = nullptr;
+		node->prevIn = &node->nextIn;
+		return;
+	}
+	node->nextIn = *headIn;
+	node->prevIn = headIn;
+	if (*headIn != nullptr)
+		(*headIn)->prevIn = &node->nextIn;
+	*headIn = node;
+}
+
+template<class T>
+void free_transition(T* node)
+{
+	*node->prev = node->next;
+	if (node->next != nullptr)
+		node->next->prev = node->prev;
+	*node->prevIn = node->nextIn;
+	if (node->nextIn != nullptr)
+		node->nextIn->prevIn = node->prevIn;
+	::free(node);
+}
+
+//repeated transitions hit the head of the source list
+template<class T>
+void move_to_front(T*& head, T* node)
+{
+	if (head == node)
+		return;
+	*node->prev = node->next;
+	if (node->next != nullptr)
+		node->next->prev = node->prev;
+	node->next = head;
+	node->prev = &head;
+	head->prev = &node->next;
+	head = node;
+}
+
 archetype* world::get_casted(archetype* g, type_diff diff, bool inst)
 {
 	if (inst && g->cleaning)
 		return nullptr;
 
+	size_t hash = entity_type::hash{}(diff.extend);
+	hash = hash_array(diff.shrink.types.data, diff.shrink.types.length, hash);
+	hash = hash_array(diff.shrink.metatypes.data, diff.shrink.metatypes.length, hash) ^ (size_t)inst;
+	for (archetype_edge* edge = g->edges; edge != nullptr; edge = edge->next)
+		if (edge->hash == hash && edge->inst == inst && edge->diff == diff)
+		{
+			move_to_front(g->edges, edge);
+			return edge->dst;
+		}
+
+	archetype* dst = build_casted(g, diff, inst);
+	archetype_edge* edge = (archetype_edge*)::malloc(sizeof(archetype_edge) + diff.get_size());
+	char* buffer = (char*)(edge + 1);
+	edge->dst = dst;
+	edge->hash = hash;
+	edge->diff = diff.clone(buffer);
+	edge->inst = inst;
+	link_transition(g->edges, dst ? &dst->edgesIn : nullptr, edge);
+	return dst;
+}
+
+archetype* world::build_casted(archetype* g, type_diff diff, bool inst)
+{
 	entity_type srcType = g->get_type();
 	const type_index* srcTypes = srcType.types.data;
 	const entity* srcMetaTypes = srcType.metatypes.data;
@@ -1077,11 +1367,11 @@ archetype* world::get_casted(archetype* g, type_diff diff, bool inst)
 	tsize_t dstSize = srcType.types.length;
 	tsize_t dstMetaSize = srcType.metatypes.length;
 	tsize_t shrSize = diff.shrink.types.length;
-	std::optional<stack_object> _so_phase0;
-	std::optional<stack_object> _so_phase1;
-	std::optional<stack_object> _so_phase2;
-	std::optional<stack_object> _so_phase3;
-	std::optional<stack_object> _so_phase4;
+	std::optional<scratch_object> _so_phase0;
+	std::optional<scratch_object> _so_phase1;
+	std::optional<scratch_object> _so_phase2;
+	std::optional<scratch_object> _so_phase3;
+	std::optional<scratch_object> _so_phase4;
 
 	//phase 0 : start copying state duto instantiate
 	if (inst && g->withTracked)
@@ -1182,23 +1472,63 @@ archetype* world::get_casted(archetype* g, type_diff diff, bool inst)
 
 chunk* world::malloc_chunk(alloc_type type)
 {
-	chunk* c = (chunk*)DotsContext->malloc(type);
+	chunk* c = (chunk*)resource->malloc(type);
 	c->ct = type;
+	memory.chunks[(int)type]++;
+	memory.chunkBytes[(int)type] += c->get_size();
 	c->count = 0;
-	c->prev = c->next = nullptr;
+	c->index = 0;
 	return c;
 }
 
+alloc_type world::pick_chunk_class(archetype* g, uint32_t hint)
+{
+	alloc_type type = g->chunkClass;
+	//batches that overflow a small chunk start a fast one, huge batches a large one
+	if (type == alloc_type::smallbin && hint > g->chunkCapacity[(int)type])
+		type = alloc_type::fastbin;
+	if ((size_t)hint * g->entitySize > DotsContext->get_bin_size(alloc_type::fastbin) * 8u)
+		type = alloc_type::largebin;
+	//keeps growing, later chunks use the next class. largebin is left to merge_chunks
+	if (type == g->chunkClass && g->chunkClass == alloc_type::smallbin && ++g->grown >= kSmallBinThreshold)
+	{
+		g->chunkClass = alloc_type::fastbin;
+		g->grown = 0;
+	}
+	return type;
+}
+
+void world::upgrade_chunk_class(archetype* g)
+{
+	if (g->chunkClass == alloc_type::largebin)
+		return;
+	alloc_type type = (alloc_type)((int)g->chunkClass + 1);
+	uint32_t capacity = g->chunkCapacity[(int)type];
+	//only if the entities fill at least half a chunk of the next class
+	if (capacity == 0 || g->size < capacity / 2)
+		return;
+	g->chunkClass = type;
+	g->grown = 0;
+	//room in chunks of the new class for everything living in smaller chunks
+	uint32_t toMove = 0, freeSlots = 0;
+	forloop(i, 0, g->chunkCount)
+	{
+		chunk* c = g->chunks[i];
+		if ((int)c->ct < (int)type)
+			toMove += c->count;
+		else
+			freeSlots += g->chunkCapacity[(int)c->ct] - c->count;
+	}
+	while (freeSlots < toMove)
+	{
+		add_chunk(g, malloc_chunk(type));
+		freeSlots += capacity;
+	}
+}
+
 chunk* world::new_chunk(archetype* g, uint32_t hint)
 {
-	chunk* c = nullptr;
-	auto size = hint * g->entitySize;
-	if (g->chunkCount < kSmallBinThreshold && size < kSmallBinSize)
-		c = malloc_chunk(alloc_type::smallbin);
-	else if (size > kFastBinSize * 8u)
-		c = malloc_chunk(alloc_type::largebin);
-	else
-		c = malloc_chunk(alloc_type::fastbin);
+	chunk* c = malloc_chunk(pick_chunk_class(g, hint));
 	add_chunk(g, c);
 
 	return c;
@@ -1209,78 +1539,112 @@ void world::add_chunk(archetype* g, chunk* c)
 	structural_change(g, c);
 	g->size += c->count;
 	c->type = g;
-	g->chunkCount++;
-	if (g->firstChunk == nullptr)
-	{
-		g->lastChunk = g->firstChunk = c;
-		if (c->count < g->chunkCapacity[(int)c->ct])
-			g->firstFree = c;
-	}
-	else if (c->count < g->chunkCapacity[(int)c->ct])
-	{
-		g->lastChunk->link(c);
-		g->lastChunk = c;
-		if (g->firstFree == nullptr)
-			g->firstFree = c;
-	}
-	else
+	g->chunkBytes += c->get_size();
+	if (g->chunkCount == g->chunkSlots)
 	{
-		g->firstChunk->link(c);
+		g->chunkSlots = std::max(g->chunkSlots * 2, 4u);
+		g->chunks = (chunk**)::realloc(g->chunks, g->chunkSlots * sizeof(chunk*));
 	}
+	c->index = g->chunkCount;
+	g->chunks[g->chunkCount++] = c;
+	rebucket_chunk(g, c, occupancy_region(g, c));
 }
 
 void world::remove_chunk(archetype* g, chunk* c)
 {
 	structural_change(g, c);
 	g->size -= c->count;
-	g->chunkCount--;
-	chunk* h = g->firstChunk;
-	if (c == g->firstFree)
-		g->firstFree = c->next;
-	remove(g->firstChunk, g->lastChunk, c);
+	g->chunkBytes -= c->get_size();
+	//move to the emptiest bucket, it ends at the tail
+	rebucket_chunk(g, c, kOccupancyBuckets);
+	swap_chunks(g, c->index, --g->chunkCount);
 	c->type = nullptr;
-	if (g->firstChunk == nullptr)
+	if (g->chunkCount == 0)
 	{
 		release_reference(g);
-		archetypes.erase(g->get_type());
+		archetypes.erase({ g->get_type(), g->hash });
 		update_queries(g, false);
-		::free(g);
+		free_archetype(g);
 	}
 }
 
-void world::mark_free(archetype* g, chunk* c)
+void world::rebucket_chunk(archetype* g, chunk* c, uint32_t region)
 {
-	remove(g->firstChunk, g->lastChunk, c);
-	if(g->lastChunk)
-		g->lastChunk->link(c);
-	g->lastChunk = c;
-	if (g->firstFree == nullptr)
-		g->firstFree = c;
-	if (g->firstChunk == nullptr)
-		g->firstChunk = c;
+	uint32_t r = chunk_region(g, c->index);
+	//cross one bucket border per step
+	while (r < region)
+	{
+		swap_chunks(g, c->index, g->freeBuckets[r] - 1);
+		--g->freeBuckets[r];
+		++r;
+	}
+	while (r > region)
+	{
+		--r;
+		swap_chunks(g, c->index, g->freeBuckets[r]);
+		++g->freeBuckets[r];
+	}
 }
 
-void world::unmark_free(archetype* g, chunk* c)
+void world::rebuild_buckets(archetype* g)
 {
-	if (g->firstFree == c)
-	{
-		g->firstFree = c->next;
-		return;
-	}
-	remove(g->firstChunk, g->lastChunk, c);
-	if (g->firstChunk)
+	std::stable_sort(g->chunks, g->chunks + g->chunkCount, [g](chunk* a, chunk* b)
+		{
+			return occupancy_region(g, a) < occupancy_region(g, b);
+		});
+	std::fill(g->freeBuckets, g->freeBuckets + kOccupancyBuckets, 0);
+	forloop(i, 0, g->chunkCount)
 	{
-		c->next = g->firstChunk->next;
-		c->link(g->firstChunk);
+		chunk* c = g->chunks[i];
+		c->index = i;
+		forloop(r, occupancy_region(g, c), kOccupancyBuckets)
+			g->freeBuckets[r]++;
 	}
-	g->firstChunk = c;
-	if (g->lastChunk == nullptr)
-		g->lastChunk = c;
 }
 
 void world::release_reference(archetype* g)
 {
-	//todo: does this make sense?
+	//drop cached transitions from and to g
+	free_edges(g);
+}
+
+void world::free_edges(archetype* g)
+{
+	while (g->edges != nullptr)
+		free_transition(g->edges);
+	while (g->plans != nullptr)
+		free_transition(g->plans);
+	while (g->edgesIn != nullptr)
+		free_transition(g->edgesIn);
+	while (g->plansIn != nullptr)
+		free_transition(g->plansIn);
+}
+
+void world::free_archetype(archetype* g)
+{
+	free_edges(g);
+	::free(g->chunks);
+	::free(g);
+}
+
+const cast_plan* world::get_cast_plan(archetype* src, archetype* dst)
+{
+	for (cast_plan* plan = src->plans; plan != nullptr; plan = plan->next)
+		if (plan->dst == dst)
+			return plan;
+	cast_plan* plan = cast_plan::build(src, dst);
+	link_transition(src->plans, &dst->plansIn, plan);
+	return plan;
+}
+
+//stream header, written on serialize and checked on deserialize
+bool world::archive_version(serializer_i* s)
+{
+	constexpr uint32_t kMagic = 0x53544F44; //"DOTS"
+	uint32_t magic = kMagic, version = kSerializeVersion;
+	archive(s, magic);
+	archive(s, version);
+	return magic == kMagic && version == kSerializeVersion;
 }
 
 void world::serialize_archetype(archetype* g, serializer_i* s)
@@ -1336,25 +1700,20 @@ archetype* world::deserialize_archetype(serializer_i* s, patcher_i* patcher, boo
 
 bool world::deserialize_slice(archetype* g, serializer_i* s, chunk_slice& slice)
 {
+	memory_scope scope(resource, bufferHeap);
 	uint32_t count;
 	archive(s, count);
 	if (count == 0)
 		return false;
-	chunk* c;
-	c = g->firstFree;
-	while (c && (c->count + count) > g->chunkCapacity[(int)c->ct])
-		c = c->next;
-	if (c == nullptr)
-	{
-		auto size = count * g->entitySize;
-		if (g->chunkCount < kSmallBinThreshold && size < kSmallBinSize)
-			c = malloc_chunk(alloc_type::smallbin);
-		else if (size > kFastBinSize)
-			c = malloc_chunk(alloc_type::largebin);
-		else
-			c = malloc_chunk(alloc_type::fastbin);
-		add_chunk(g, c);
-	}
+	chunk* c = nullptr;
+	forloop(i, g->freeBuckets[0], g->chunkCount)
+		if (g->chunks[i]->count + count <= g->chunkCapacity[(int)g->chunks[i]->ct])
+		{
+			c = g->chunks[i];
+			break;
+		}
+	if (c == nullptr)
+		c = new_chunk(g, count);
 	uint32_t start = c->count;
 	resize_chunk(c, start + count);
 	slice = { c, start, count };
@@ -1449,23 +1808,13 @@ void world::prefab_to_group(entity* members, uint32_t size)
 	}
 }
 
-adaptive_object flatten_group_impl(world* wld, buffer* group, entity*& arr, uint32_t& size)
-{
-	wld->estimate_group_size(size, group);
-	AO(entity, members, size);
-	size = 0;
-	wld->flatten_group(members, size, group);
-	arr = members;
-	//should user promise groups dont overlap?
-	//std::sort(members, members + size);
-	//auto end = std::unique(members, members + size);
-	//size = end - members;
-	return _ao_members;
-}
-
+//should user promise groups dont overlap?
 #define FG(group, arr, size) \
-entity* arr; uint32_t size=0;\
-auto _ao_##name = flatten_group_impl(this, group, arr, size);
+uint32_t size = 0; \
+estimate_group_size(size, group); \
+stack_array(entity, arr, size); \
+size = 0; \
+flatten_group(arr, size, group);
 
 chunk_vector<chunk_slice> world::instantiate_group(buffer* group, uint32_t count)
 {
@@ -1480,8 +1829,8 @@ chunk_vector<chunk_slice> world::instantiate_prefab(entity* src, uint32_t size,
 {
 	chunk_vector<chunk_slice> allSlices;
 	
-	AO(entity, ret, size * count);
-	AO(uint32_t, scount, size);
+	stack_array(entity, ret, size * count);
+	stack_array(uint32_t, scount, size);
 	memset(scount, 0, sizeof(uint32_t) * size);
 
 	forloop(i, 0, size)
@@ -1535,6 +1884,7 @@ chunk_vector<chunk_slice> world::instantiate_single(entity src, uint32_t count)
 	chunk_vector<chunk_slice> result;
 	const auto& data = ents.datas[src.id];
 	archetype* g = get_casted(data.c->type, {}, true);
+	memory_scope scope(resource, bufferHeap);
 	uint32_t k = 0;
 	while (k < count)
 	{
@@ -1577,7 +1927,8 @@ void world::structural_change(archetype* g, chunk* c)
 		}
 	}
 	auto timestamps = g->timestamps(c);
-	forloop(i, 0, t.types.length)
+	//tags have no timestamp slot
+	forloop(i, 0, g->firstTag)
 		timestamps[i] = timestamp;
 }
 
@@ -1601,6 +1952,7 @@ void world::destroy_single(chunk_slice s)
 	g = get_cleaning(g);
 	if (g == nullptr)
 	{
+		chunk::destruct(s);
 		ents.free_entities(s);
 		free_slice(s);
 	}
@@ -1620,107 +1972,71 @@ void world::destroy_chunk(archetype* g, chunk* c)
 
 void world::recycle_chunk(chunk* c)
 {
-	DotsContext->free(c->ct, c);
+	memory.chunks[(int)c->ct]--;
+	memory.chunkBytes[(int)c->ct] -= c->get_size();
+	resource->free(c->ct, c);
+	//buffers of the chunk are pooled by now, hand slabs back once another slab's worth piled up
+	if (bufferHeap != nullptr && bufferHeap->pooledBytes.load(std::memory_order_relaxed) >= bufferHeap->trimmedAt.load(std::memory_order_relaxed) + kFastBinSize)
+		bufferHeap->trim();
 }
 
 void world::resize_chunk(chunk* c, uint32_t count)
 {
 	archetype* g = c->type;
+	//callers already took the removed entities off g->size, remove_chunk must not subtract them again
+	c->count = count;
 	if (count == 0)
 		destroy_chunk(g, c);
 	else
-	{
-		if (count == g->chunkCapacity[(int)c->ct])
-			unmark_free(g, c);
-		else if (c->count == g->chunkCapacity[(int)c->ct])
-			mark_free(g, c);
-		c->count = count;
-	}
+		rebucket_chunk(g, c, occupancy_region(g, c));
 }
 
 void world::merge_chunks(archetype* g)
 {
+	//outgrown archetypes move to bigger chunks, merging below drains the smaller ones
+	upgrade_chunk_class(g);
 	//zero or one chunk
-	if (g->firstChunk == nullptr || g->firstChunk->next == nullptr)
+	if (g->chunkCount < 2)
 		return;
 
 	//sort by capacity and fill rate
-	auto unsorted = g->firstChunk->next;
-	chunk* toSort = unsorted;
-	while (unsorted != nullptr)
-	{
-		toSort = unsorted;
-		unsorted = unsorted->next;
-		auto iter = g->firstChunk;
-		while (iter != unsorted)
+	std::sort(g->chunks, g->chunks + g->chunkCount, [](chunk* a, chunk* b)
 		{
-			if ((int)iter->ct < (int)toSort->ct || iter->count < toSort->count)
-			{
-				toSort->unlink();
-				toSort->prev = iter->prev;
-				toSort->next = iter;
-				if (iter->prev != nullptr)
-				{
-					iter->prev->next = toSort;
-					iter->prev = toSort;
-				}
-				else
-				{
-					iter->prev = toSort;
-					g->firstChunk = toSort;
-				}
-				break;
-			}
-			iter = iter->next;
-		}
-	}
-	if (toSort != nullptr)
-		g->lastChunk = toSort;
-
-	//merge into large chunk if can
-	auto mergeableSize = g->size;
-	auto iter = g->firstChunk;
-	auto largeSize = g->chunkCapacity[(int)alloc_type::largebin];
-	while (iter->ct == alloc_type::largebin)
-	{
-		mergeableSize = mergeableSize > largeSize ?
-			mergeableSize - largeSize : 0u;
-	}
-	while (mergeableSize > largeSize)
-	{
-		auto c = malloc_chunk(alloc_type::largebin);
-		g->firstChunk = c;
-		mergeableSize -= largeSize;
-	}
+			if (a->ct != b->ct)
+				return (int)a->ct > (int)b->ct;
+			return a->count > b->count;
+		});
+	forloop(i, 0, g->chunkCount)
+		g->chunks[i]->index = i;
+	//everything in the last bucket while chunks are drained
+	std::fill(g->freeBuckets, g->freeBuckets + kOccupancyBuckets, 0);
 
 	//merge smallest chunk into largest chunk
-	auto dst = g->firstChunk;
-	while (dst != g->lastChunk)
+	uint32_t i = 0;
+	while (i < g->chunkCount - 1)
 	{
-		auto src = g->lastChunk;
+		auto dst = g->chunks[i];
+		auto src = g->chunks[g->chunkCount - 1];
 		auto fullSize = g->chunkCapacity[(int)dst->ct];
 		auto freeSize = fullSize - dst->count;
 		auto moveSize = std::min(freeSize, src->count);
-		dst->move({ dst, dst->count, moveSize }, src, src->count - moveSize);
+		chunk::move({ dst, dst->count, moveSize }, src, src->count - moveSize);
 		ents.move_entities({ dst, dst->count, moveSize }, src, src->count - moveSize);
 		dst->count += moveSize;
 		src->count -= moveSize;
 		if (dst->count == fullSize)
-			dst = dst->next;
+			++i;
 		if (src->count == 0)
 			destroy_chunk(g, src);
 	}
 
-	//maintain firstFree
-	if (dst->count != g->chunkCapacity[(int)dst->ct])
-		g->firstFree = dst;
-	else
-		g->firstFree = nullptr;
+	rebuild_buckets(g);
 }
 
 chunk_slice world::allocate_slice(archetype* g, uint32_t count)
 {
-	chunk* c = g->firstFree;
+	//fill the fullest chunk first, keeps live data dense
+	chunk* c = g->freeBuckets[0] < g->chunkCount ? g->chunks[g->freeBuckets[0]] : nullptr;
 	if (c == nullptr)
 		c = new_chunk(g, count);
 	structural_change(g, c);
@@ -1751,12 +2067,12 @@ chunk_vector<chunk_slice> world::cast_slice(chunk_slice src, archetype* g)
 	chunk_vector<chunk_slice> result;
 	archetype* srcG = src.c->type;
 	structural_change(srcG, src.c);
-	srcG->size -= src.count;
+	const cast_plan* plan = get_cast_plan(srcG, g);
 	uint32_t k = 0;
 	while (k < src.count)
 	{
 		chunk_slice s = allocate_slice(g, src.count - k);
-		chunk::cast(s, src.c, src.start + k);
+		chunk::cast(s, src.c, src.start + k, plan);
 		ents.move_entities(s, src.c, src.start + k);
 		k += s.count;
 		result.push(s);
@@ -1792,6 +2108,7 @@ chunk_vector<chunk_slice> world::cast(chunk_slice s, archetype* g)
 {
 	if (g == nullptr)
 	{
+		chunk::destruct(s);
 		ents.free_entities(s);
 		free_slice(s);
 		return {};
@@ -1812,20 +2129,35 @@ chunk_vector<chunk_slice> world::cast(chunk_slice s, archetype* g)
 	}
 }
 
-world::world(uint32_t typeCapacity)
-	:typeCapacity(typeCapacity)
+world::world(uint32_t typeCapacity, memory_resource_i* resource)
+	:typeCapacity(typeCapacity), resource(resource ? resource : context::default_resource()),
+	bufferHeap(new buffer_heap(this->resource)), bufferSizes(nullptr)
 {
+	DotsContext->worlds.fetch_add(1, std::memory_order_release);
+	ents.datas.resource = this->resource;
 	typeTimestamps = (uint32_t*)::malloc(typeCapacity * sizeof(uint32_t));
 	memset(typeTimestamps, 0, typeCapacity * sizeof(uint32_t));
 }
 
 world::world(const world& other)
 {
+	DotsContext->worlds.fetch_add(1, std::memory_order_release);
 	auto& src = const_cast<world&>(other);
+	resource = src.resource;
+	bufferHeap = new buffer_heap(resource);
+	budget = src.budget;
+	on_budget_exceeded = src.on_budget_exceeded;
+	memory_scope scope(resource, bufferHeap);
 	timestamp = src.timestamp;
 	typeCapacity = src.typeCapacity;
 	typeTimestamps = (uint32_t*)::malloc(typeCapacity * sizeof(uint32_t));
 	std::fill(typeTimestamps, typeTimestamps + typeCapacity, 0);
+	bufferSizes = nullptr;
+	if (src.bufferSizes != nullptr)
+	{
+		bufferSizes = (uint16_t*)::malloc(typeCapacity * sizeof(uint16_t));
+		memcpy(bufferSizes, src.bufferSizes, typeCapacity * sizeof(uint16_t));
+	}
 	src.ents.clone(&ents);
 	for (auto& iter : src.archetypes)
 	{
@@ -1835,22 +2167,36 @@ world::world(const world& other)
 		auto size = g->get_size() + sizeof(archetype);
 		archetype* newG = (archetype*)::malloc(size);
 		memcpy(newG, g, size);
+		bind_inline(newG);
+		newG->edges = nullptr;
+		newG->plans = nullptr;
+		newG->edgesIn = nullptr;
+		newG->plansIn = nullptr;
 
 		// mark copying stage
 		forloop(i, 0, newG->componentCount)
 		{
 			auto type = (type_index)newG->types[i];
 			if ((DotsContext->tracks[type.index()] & ManualCopying) != 0)
+			{
 				newG->types[i] = type_index(type) + 1;
+				newG->signature.overflow = true; //shifted ids may alias other types, match by value
+			}
 		}
+		newG->build_lookup();
 
 		//clone chunks
-		newG->firstChunk = newG->firstFree = newG->lastChunk = nullptr;
-		for (auto c = g->firstChunk; c != nullptr; c = c->next)
+		newG->chunks = nullptr;
+		newG->chunkCount = newG->chunkSlots = 0;
+		std::fill(newG->freeBuckets, newG->freeBuckets + kOccupancyBuckets, 0);
+		newG->chunkBytes = 0;
+		newG->size = 0;
+		forloop(i, 0, g->chunkCount)
 		{
+			auto c = g->chunks[i];
 			auto newC = malloc_chunk(c->ct);
 			c->clone(newC);
-			add_chunk(newG, c);
+			add_chunk(newG, newC);
 		}
 		add_archetype(newG);
 	}
@@ -1859,29 +2205,65 @@ world::world(const world& other)
 world::world(world&& other)
 	:archetypes(std::move(other.archetypes)),
 	queries(std::move(other.queries)),
+	queryIndex(std::move(other.queryIndex)),
+	unanchoredQueries(std::move(other.unanchoredQueries)),
+	archetypeQueries(std::move(other.archetypeQueries)),
+	queryVisit(other.queryVisit),
 	ents(std::move(other.ents)),
 	typeTimestamps(other.typeTimestamps),
 	typeCapacity(other.typeCapacity),
+	resource(other.resource),
+	bufferHeap(other.bufferHeap),
+	memory(other.memory),
+	bufferSizes(other.bufferSizes),
+	budget(other.budget),
+	on_budget_exceeded(std::move(other.on_budget_exceeded)),
 	timestamp(other.timestamp)
 {
+	DotsContext->worlds.fetch_add(1, std::memory_order_release);
 	other.typeTimestamps = nullptr;
+	other.bufferHeap = nullptr;
+	other.bufferSizes = nullptr;
+	other.memory = {};
 }
 
 world::~world()
 {
+	DotsContext->worlds.fetch_sub(1, std::memory_order_release);
 	clear();
 	if(typeTimestamps != nullptr)
 		free(typeTimestamps);
+	if (bufferSizes != nullptr)
+		free(bufferSizes);
+	if (bufferHeap != nullptr)
+		bufferHeap->release();
 }
 
 void world::operator=(world&& other)
 {
 	archetypes = std::move(other.archetypes);
 	queries = std::move(other.queries);
+	queryIndex = std::move(other.queryIndex);
+	unanchoredQueries = std::move(other.unanchoredQueries);
+	archetypeQueries = std::move(other.archetypeQueries);
+	queryVisit = other.queryVisit;
 	ents = std::move(other.ents);
 	typeTimestamps = other.typeTimestamps;
 	other.typeTimestamps = nullptr;
 	typeCapacity = other.typeCapacity;
+	resource = other.resource;
+	if (bufferHeap != nullptr)
+		bufferHeap->release();
+	bufferHeap = other.bufferHeap;
+	other.bufferHeap = nullptr;
+	memory = other.memory;
+	other.memory = {};
+	if (bufferSizes != nullptr)
+		free(bufferSizes);
+	bufferSizes = other.bufferSizes;
+	other.bufferSizes = nullptr;
+	budget = other.budget;
+	on_budget_exceeded = std::move(other.on_budget_exceeded);
 	timestamp = other.timestamp;
 }
 
@@ -1894,6 +2276,8 @@ chunk_vector<chunk_slice> world::allocate(const entity_type& type, uint32_t coun
 chunk_vector<chunk_slice> world::allocate(archetype* g, uint32_t count)
 {
 	chunk_vector<chunk_slice> result;
+	if (!check_budget(g, count))
+		return result;
 	uint32_t k = 0;
 
 	while (k < count)
@@ -1910,6 +2294,9 @@ chunk_vector<chunk_slice> world::allocate(archetype* g, uint32_t count)
 chunk_vector<chunk_slice> world::instantiate(entity src, uint32_t count)
 {
 	auto group_data = (buffer*)get_component_ro(src, group_id);
+	//note: group members are not estimated
+	if (!check_budget(get_archetype(src), count))
+		return {};
 	if (group_data == nullptr)
 	{
 		return instantiate_single(src, count);
@@ -1993,7 +2380,7 @@ void world::destroy(chunk_slice s)
 		forloop(i, 0, s.count)
 		{
 			auto* group_data = (buffer*)(src + (size_t)i * sizes[i]);
-			uint16_t size = group_data->size / sizeof(entity);
+			uint32_t size = group_data->size / sizeof(entity);
 			forloop(j, 1, size)
 			{
 				entity e = ((entity*)group_data->data())[i];
@@ -2174,7 +2561,9 @@ const entity* world::get_entities(chunk_slice s) noexcept
 
 uint16_t world::get_size(type_index t) const noexcept
 {
-	return DotsContext->infos[((type_index)t).index()].size;
+	if (bufferSizes != nullptr && bufferSizes[t.index()] != 0)
+		return bufferSizes[t.index()];
+	return DotsContext->infos[t.index()].size;
 }
 
 entity_type world::get_type(entity e) const noexcept
@@ -2247,6 +2636,7 @@ chunk_vector<entity> world::gather_reference(entity e)
 
 void world::serialize(serializer_i* s, entity src)
 {
+	archive_version(s);
 	auto group_data = (buffer*)get_component_ro(src, group_id);
 	if (group_data == nullptr)
 		serialize_single(s, src);
@@ -2276,6 +2666,8 @@ void world::deserialize_prefab(serializer_i* s, patcher_i* patcher, buffer* grou
 
 entity world::deserialize(serializer_i* s, patcher_i* patcher)
 {
+	if (!archive_version(s))
+		return NullEntity;
 	auto root = deserialize_single(s, patcher);
 	auto group_data = (buffer*)get_component_ro(root, group_id);
 	auto result = first_entity(root);
@@ -2283,7 +2675,7 @@ entity world::deserialize(serializer_i* s, patcher_i* patcher)
 	{
 		chunk_vector<entity> prefab; prefab.push(result);
 		deserialize_prefab(s, patcher, group_data, prefab);
-		AO(entity, members, prefab.size);
+		stack_array(entity, members, prefab.size);
 		prefab.flatten(members);
 		prefab_to_group(members, prefab.size);
 	}
@@ -2292,14 +2684,32 @@ entity world::deserialize(serializer_i* s, patcher_i* patcher)
 
 void world::move_context(world& src)
 {
+	//adaptive buffers of src may be laid out differently, match our layout before taking chunks
+	if (src.bufferSizes != nullptr || bufferSizes != nullptr)
+	{
+		std::vector<type_index> mismatched;
+		for (auto& pair : src.archetypes)
+		{
+			archetype* g = pair.second;
+			forloop(i, g->firstBuffer, g->firstManaged)
+			{
+				type_index type = to_valid_type(g->types[i]);
+				if (g->sizes[i] != get_size(type) &&
+					std::find(mismatched.begin(), mismatched.end(), type) == mismatched.end())
+					mismatched.push_back(type);
+			}
+		}
+		for (auto type : mismatched)
+			src.relayout_buffer(type, get_size(type));
+	}
 	auto& sents = src.ents;
 	uint32_t count = (uint32_t)sents.datas.size;
-	AO(entity, patch, count);
+	stack_array(entity, patch, count);
 	int validCount = 0;
 	forloop(i, 0, count)
 		if (sents.datas[i].c != nullptr)
 			validCount++;
-	AO(entity, entities, validCount);
+	stack_array(entity, entities, validCount);
 	//batch new to trigger fast path
 	ents.new_entities(entities, validCount);
 	validCount = 0;
@@ -2328,16 +2738,29 @@ void world::move_context(world& src)
 	{
 		archetype* g = pair.second;
 		archetype* dstG = get_archetype(g->get_type());
-		for (chunk* c = g->firstChunk; c;)
+		forloop(i, 0, g->chunkCount)
 		{
-			chunk* next = c->next;
+			chunk* c = g->chunks[i];
+			if (src.resource != resource)
+			{
+				//chunks must go back to the resource they came from
+				chunk* newC = malloc_chunk(c->ct);
+				memcpy(newC, c, c->get_size());
+				src.recycle_chunk(c);
+				c = newC;
+			}
+			else
+			{
+				src.memory.chunks[(int)c->ct]--;
+				src.memory.chunkBytes[(int)c->ct] -= c->get_size();
+				memory.chunks[(int)c->ct]++;
+				memory.chunkBytes[(int)c->ct] += c->get_size();
+			}
 			add_chunk(dstG, c);
 			patch_chunk(c, &p);
-			c = next;
 		}
 		src.update_queries(g, false);
-		src.release_reference(g);
-		free(g);
+		free_archetype(g);
 	}
 	src.archetypes.clear();
 }
@@ -2417,14 +2840,13 @@ world_delta world::diff_context(world& base)
 		if (guid_l == InvalidIndex)
 			continue;
 
-		chunk* c = g->firstChunk;
-		while (c != nullptr)
+		forloop(k, 0, g->chunkCount)
 		{
+			chunk* c = g->chunks[k];
 			auto guids = (GUID*)(c->data() + g->offsets[(int)c->ct][guid_l]);
 			auto ents = c->get_entities();
 			forloop(i, 0, c->count)
 				entityMap.insert({ guids[i], ents[i] });
-			c = c->next;
 		}
 	}
 	for (auto& pair : archetypes)
@@ -2433,11 +2855,11 @@ world_delta world::diff_context(world& base)
 		auto guid_l = g->index(guid_id);
 		if (guid_l == InvalidIndex)
 			continue;
-		chunk* c = g->firstChunk;
 		auto type = g->get_type();
 		
-		while (c != nullptr)
+		forloop(k, 0, g->chunkCount)
 		{
+			chunk* c = g->chunks[k];
 			//entity operations are batched, thus diff could be batched too
 			chunk_slice slice{ c, 0, 0 };
 			while (slice.start != c->count)
@@ -2502,7 +2924,7 @@ world_delta world::diff_context(world& base)
 							{
 								world_delta::vector_delta dt;
 								buffer* b = (buffer*)(data + (size_t)g->sizes[i] * j);
-								uint16_t n = b->size / t.elementSize;
+								uint32_t n = b->size / t.elementSize;
 								dt.length = n;
 								dt.content.push_back(buf.write(b->data(), b->size));
 								delta.bufferDiffs[i].emplace_back(std::move(dt));
@@ -2518,8 +2940,8 @@ world_delta world::diff_context(world& base)
 								world_delta::vector_delta dt;
 								buffer* baseB = (buffer*)(data + (size_t)g->sizes[i] * j); 
 								buffer* b = (buffer*)(data + (size_t)g->sizes[i] * j);
-								uint16_t baseN = baseB->size / t.elementSize;
-								uint16_t n = b->size / t.elementSize;
+								uint32_t baseN = baseB->size / t.elementSize;
+								uint32_t n = b->size / t.elementSize;
 								dt.length = n;
 								uint32_t diffed = std::min(baseB->size, b->size);
 								dt.content = diff_array(baseB->data(), b->data(), diffed, t.elementSize, buf);
@@ -2548,7 +2970,6 @@ world_delta world::diff_context(world& base)
 				slice.start += slice.count;
 				slice.count = 0;
 			}
-			c = c->next;
 		}
 	}
 	{
@@ -2571,6 +2992,7 @@ void world::patch_chunk(chunk_slice s, patcher_i* patcher)
 const int ZeroValue = 0;
 void world::serialize(serializer_i* s)
 {
+	archive_version(s);
 	archive(s, ents.datas.size);
 
 	std::vector<archetype*> ats;
@@ -2585,17 +3007,18 @@ void world::serialize(serializer_i* s)
 	archive(s, ZeroValue);
 	for (archetype* g : ats)
 	{
-		for (chunk* c = g->firstChunk; c; c = c->next)
-			serialize_slice({ c, 0, c->count }, s);
+		forloop(i, 0, g->chunkCount)
+			serialize_slice({ g->chunks[i], 0, g->chunks[i]->count }, s);
 
 		archive(s, ZeroValue);
 	}
 }
 
-void world::deserialize(serializer_i* s)
+bool world::deserialize(serializer_i* s)
 {
 	clear();
-
+	if (!archive_version(s))
+		return false;
 	archive(s, ents.datas.size);
 
 	//reallocate entity data buffer
@@ -2632,13 +3055,14 @@ void world::deserialize(serializer_i* s)
 		if (data.c == nullptr)
 		{
 			data.nextFree = ents.free;
-			ents.free = static_cast<uint32_t>(i);
+			ents.free = static_cast<entity::underlying_type>(i);
 		}
 	}
 
 	//update query till all meta entity is complete
 	for (archetype* g : ats)
 		add_archetype(g);
+	return true;
 }
 
 void world::clear()
@@ -2647,65 +3071,411 @@ void world::clear()
 		std::fill(typeTimestamps, typeTimestamps + typeCapacity, 0);
 	for (auto& g : archetypes)
 	{
-		chunk* c = g.second->firstChunk;
-		while (c != nullptr)
+		forloop(i, 0, g.second->chunkCount)
 		{
-			chunk* next = c->next;
+			chunk* c = g.second->chunks[i];
 			chunk::destruct({ c,0,c->count });
 			recycle_chunk(c);
-			c = next;
 		}
 		if(on_archetype_update)
 			on_archetype_update(g.second, false);
-		release_reference(g.second);
-		free(g.second);
+		free_archetype(g.second);
 	}
 	ents.clear();
 	queries.clear();
+	memory.queryBytes = 0;
+	queryIndex.clear();
+	unanchoredQueries.clear();
+	archetypeQueries.clear();
 	archetypes.clear();
 }
 
 void world::gc_meta()
 {
+	std::vector<archetype*> invalids;
 	for (auto& gi : archetypes)
 	{
 		auto g = gi.second;
 		auto mt = g->metatypes;
-		bool invalid = false;
 		forloop(i, 0, g->metaCount)
 		{
 			if (!exist(mt[i]))
 			{
-				invalid = true;
+				invalids.push_back(g);
 				break;
 			}
 		}
-		if (invalid)
+	}
+	for (auto g : invalids)
+	{
+		auto mt = g->metatypes;
+		//cached transitions are keyed by the old type
+		release_reference(g);
+		//note: remove from map before we edit the type
+		//or key will be broken
+		archetypes.erase({ g->get_type(), g->hash });
+		//keep metatypes sorted
+		g->metaCount = tsize_t(std::remove_if(mt, mt + g->metaCount, [&](entity e) { return !exist(e); }) - mt);
+		g->hash = entity_type::hash{}(g->get_type());
+		archetypes.insert({ { g->get_type(), g->hash }, g });
+	}
+}
+
+void world::merge_chunks()
+{
+	adapt_buffers();
+	for (auto& pair : archetypes)
+	{
+		archetype* g = pair.second;
+		merge_chunks(g);
+	}
+}
+
+chunk* world::defrag_source(archetype* g)
+{
+	//emptiest chunk holding entities, empty chunks are kept as reserved
+	uint32_t i = g->chunkCount;
+	while (i > g->freeBuckets[0] && g->chunks[i - 1]->count == 0)
+		--i;
+	if (i <= g->freeBuckets[0])
+		return nullptr;
+	chunk* src = g->chunks[i - 1];
+	//only worth moving if fuller chunks can take all of it
+	uint32_t freeSlots = 0;
+	forloop(j, g->freeBuckets[0], i - 1)
+	{
+		chunk* c = g->chunks[j];
+		if (c->count != 0)
+			freeSlots += g->chunkCapacity[(int)c->ct] - c->count;
+	}
+	return freeSlots >= src->count ? src : nullptr;
+}
+
+archetype* world::next_defrag_target()
+{
+	forloop(k, 0, archetypes.size())
+	{
+		if (defragCursor >= archetypes.size())
+			defragCursor = 0;
+		archetype* g = archetypes.begin()[defragCursor].second;
+		if (defrag_source(g) != nullptr)
+			return g;
+		++defragCursor;
+	}
+	return nullptr;
+}
+
+size_t world::defragment(archetype* g, const defrag_budget& budget)
+{
+	using clock = std::chrono::steady_clock;
+	auto start = clock::now();
+	size_t moved = 0;
+	chunk* src = defrag_source(g);
+	if (src != nullptr && on_defragment)
+		on_defragment(g);
+	while (src != nullptr)
+	{
+		if (budget.bytes != 0 && moved + g->entitySize > budget.bytes)
+			break;
+		if (budget.time.count() != 0 && clock::now() - start >= budget.time)
+			break;
+		//fullest chunk with free slots
+		chunk* dst = nullptr;
+		forloop(i, g->freeBuckets[0], g->chunkCount)
+		{
+			dst = g->chunks[i];
+			if (dst != src && dst->count != 0)
+				break;
+		}
+		uint32_t count = std::min(src->count, g->chunkCapacity[(int)dst->ct] - dst->count);
+		if (budget.bytes != 0)
+			count = std::min(count, (uint32_t)((budget.bytes - moved) / g->entitySize));
+		uint32_t dstIndex = dst->count, srcIndex = src->count - count;
+		chunk::move({ dst, dstIndex, count }, src, srcIndex);
+		ents.move_entities({ dst, dstIndex, count }, src, srcIndex);
+		//both chunks changed for chunk filters
+		structural_change(g, dst);
+		structural_change(g, src);
+		resize_chunk(dst, dstIndex + count);
+		if (srcIndex == 0)
+			memory.defragChunks++;
+		resize_chunk(src, srcIndex);
+		moved += (size_t)count * g->entitySize;
+		src = defrag_source(g);
+	}
+	memory.defragBytes += moved;
+	return moved;
+}
+
+size_t world::defragment(const defrag_budget& budget)
+{
+	using clock = std::chrono::steady_clock;
+	auto start = clock::now();
+	size_t moved = 0;
+	while (archetype* g = next_defrag_target())
+	{
+		defrag_budget remaining;
+		if (budget.bytes != 0)
+		{
+			if (moved + g->entitySize > budget.bytes)
+				break;
+			remaining.bytes = budget.bytes - moved;
+		}
+		if (budget.time.count() != 0)
+		{
+			auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start);
+			if (elapsed >= budget.time)
+				break;
+			remaining.time = budget.time - elapsed;
+		}
+		moved += defragment(g, remaining);
+	}
+	return moved;
+}
+
+archetype* world::relayout(archetype* g)
+{
+	memory_scope scope(resource, bufferHeap);
+	//note: remove from map before we free the key
+	archetypes.erase({ g->get_type(), g->hash });
+	update_queries(g, false);
+	archetype* dstG = construct_archetype(g->get_type());
+	add_archetype(dstG);
+	forloop(i, 0, g->chunkCount)
+	{
+		chunk* c = g->chunks[i];
+		uint32_t k = 0;
+		while (k < c->count)
+		{
+			chunk_slice s = allocate_slice(dstG, c->count - k);
+			chunk::relayout(s, c, k);
+			ents.move_entities(s, c, k);
+			k += s.count;
+		}
+		recycle_chunk(c);
+	}
+	release_reference(g);
+	free_archetype(g);
+	return dstG;
+}
+
+uint32_t world::relayout_buffer(type_index type, uint16_t size)
+{
+	if (bufferSizes == nullptr)
+	{
+		bufferSizes = (uint16_t*)::malloc(typeCapacity * sizeof(uint16_t));
+		memset(bufferSizes, 0, typeCapacity * sizeof(uint16_t));
+	}
+	auto index = type.index();
+	bool withCopying = index + 1 < DotsContext->tracks.size() && DotsContext->tracks[index + 1] == Copying;
+	bufferSizes[index] = size == DotsContext->infos[index].size ? 0 : size;
+	if (withCopying)
+		bufferSizes[index + 1] = bufferSizes[index];
+
+	stack_array(archetype*, affected, (uint32_t)archetypes.size());
+	uint32_t count = 0;
+	for (auto& pair : archetypes)
+	{
+		archetype* g = pair.second;
+		tsize_t id = g->index(type);
+		if (id == InvalidIndex && withCopying)
+			id = g->index(type_index(type) + 1);
+		if (id != InvalidIndex && g->sizes[id] != size)
+			affected[count++] = g;
+	}
+	forloop(i, 0u, count)
+		relayout(affected[i]);
+	return count;
+}
+
+void world::set_buffer_capacity(type_index type, uint32_t capacity)
+{
+	const auto& info = DotsContext->infos[type.index()];
+	if (!type.is_buffer() || !info.adaptiveCapacity)
+		return;
+	size_t size = sizeof(buffer) + (size_t)capacity * info.elementSize;
+	size = (size + alignof(buffer) - 1) / alignof(buffer) * alignof(buffer);
+	relayout_buffer(type, (uint16_t)std::min<size_t>(size, UINT16_MAX));
+}
+
+uint32_t world::adapt_buffers(float coverage)
+{
+	//log2 histogram of element counts, bucket i holds buffers of at most 2^i elements
+	struct histogram
+	{
+		type_index type;
+		uint32_t total = 0;
+		uint32_t buckets[33] = {};
+	};
+	std::vector<histogram> histograms;
+	for (auto& pair : archetypes)
+	{
+		archetype* g = pair.second;
+		forloop(i, g->firstBuffer, g->firstManaged)
 		{
-			//note: remove from map before we edit the type
-			//or key will be broken
-			archetypes.erase(g->get_type());
-			forloop(i, 0, g->metaCount)
+			type_index type = to_valid_type(g->types[i]);
+			const auto& info = DotsContext->infos[type.index()];
+			if (!info.adaptiveCapacity)
+				continue;
+			auto iter = std::find_if(histograms.begin(), histograms.end(),
+				[&](const histogram& h) { return h.type == type; });
+			if (iter == histograms.end())
 			{
-				if (!exist(mt[i]))
+				histograms.push_back({ type });
+				iter = histograms.end() - 1;
+			}
+			forloop(k, 0, g->chunkCount)
+			{
+				chunk* c = g->chunks[k];
+				char* arr = c->data() + g->offsets[(int)c->ct][i];
+				forloop(j, 0u, c->count)
 				{
-					if (i + 1 != g->metaCount)
-						std::swap(mt[i], mt[g->metaCount - 1]);
-					g->metaCount--;
+					buffer* b = (buffer*)(arr + (size_t)j * g->sizes[i]);
+					uint64_t n = b->size / info.elementSize;
+					int bucket = 0;
+					while ((uint64_t(1) << bucket) < n)
+						++bucket;
+					iter->buckets[bucket]++;
+					iter->total++;
 				}
 			}
-			archetypes.insert({ g->get_type(), g });
 		}
 	}
+
+	uint32_t relayouted = 0;
+	for (auto& h : histograms)
+	{
+		if (h.total == 0)
+			continue;
+		const auto& info = DotsContext->infos[h.type.index()];
+		uint32_t covered = 0, bucket = 0;
+		while (bucket < 32 && covered + h.buckets[bucket] < coverage * h.total)
+			covered += h.buckets[bucket++];
+		uint64_t capacity = uint64_t(1) << bucket;
+		uint64_t maxCapacity = (kMaxAdaptiveInlineSize - sizeof(buffer)) / info.elementSize;
+		capacity = std::max<uint64_t>(std::min(capacity, maxCapacity), 1);
+		size_t size = sizeof(buffer) + capacity * info.elementSize;
+		size = (size + alignof(buffer) - 1) / alignof(buffer) * alignof(buffer);
+		if (size != get_size(h.type))
+			relayouted += relayout_buffer(h.type, (uint16_t)size);
+	}
+	return relayouted;
 }
 
-void world::merge_chunks()
+bool world::check_budget(archetype* g, uint32_t count)
+{
+	if (budget == 0)
+		return true;
+	//estimate with chunks of the archetype's class once free slots run out
+	uint32_t remaining = count;
+	for (uint32_t i = g->freeBuckets[0]; i < g->chunkCount && remaining > 0; ++i)
+		remaining -= std::min(remaining, g->chunkCapacity[(int)g->chunks[i]->ct] - g->chunks[i]->count);
+	uint32_t capacity = std::max(g->chunkCapacity[(int)g->chunkClass], 1u);
+	size_t required = (size_t)(remaining + capacity - 1) / capacity * DotsContext->get_bin_size(g->chunkClass);
+	required += (size_t)count * sizeof(entities::data);
+	forloop(i, 0, 2)
+	{
+		size_t total = get_memory_stats().total() + required;
+		if (total <= budget)
+			return true;
+		if (i != 0 || !on_budget_exceeded || !on_budget_exceeded(*this, total))
+			break;
+	}
+	memory.budgetFailures++;
+	return false;
+}
+
+buffer_stats world::get_buffer_stats() const
 {
+	buffer_stats stats;
 	for (auto& pair : archetypes)
 	{
 		archetype* g = pair.second;
-		merge_chunks(g);
+		forloop(i, g->firstBuffer, g->firstManaged)
+		{
+			forloop(k, 0, g->chunkCount)
+			{
+				chunk* c = g->chunks[k];
+				char* arr = c->data() + g->offsets[(int)c->ct][i];
+				forloop(j, 0, c->count)
+				{
+					buffer* b = (buffer*)(arr + (size_t)j * g->sizes[i]);
+					if (b->d == nullptr)
+						stats.inlineBuffers++;
+					else
+					{
+						stats.overflowBuffers++;
+						stats.overflowBytes += b->capacity;
+					}
+				}
+			}
+		}
+	}
+	if (bufferHeap != nullptr)
+	{
+		stats.heapAllocs = bufferHeap->allocs.load(std::memory_order_relaxed);
+		stats.heapReuses = bufferHeap->reuses.load(std::memory_order_relaxed);
+		stats.heapOversized = bufferHeap->oversized.load(std::memory_order_relaxed);
+		std::lock_guard<std::mutex> guard(bufferHeap->lock);
+		stats.slabBytes = bufferHeap->slabs.size() * kFastBinSize;
+	}
+	return stats;
+}
+
+world_memory_stats world::get_memory_stats() const
+{
+	world_memory_stats stats = memory;
+	stats.entityBytes = ents.datas.chunkSize * chunk_vector_base::kChunkSize;
+	if (ents.datas.chunkCapacity != chunk_vector_base::kChunkSize)
+		stats.entityBytes += ents.datas.chunkCapacity;
+	stats.bufferBytes = bufferHeap ? bufferHeap->bytes.load(std::memory_order_relaxed) : 0;
+	return stats;
+}
+
+archetype_stats world::get_archetype_stats(const archetype* g) const
+{
+	archetype_stats stats;
+	stats.chunks = g->chunkCount;
+	stats.entities = g->size;
+	forloop(i, 0, g->chunkCount)
+	{
+		int ct = (int)g->chunks[i]->ct;
+		stats.capacity += g->chunkCapacity[ct];
+		stats.paddingBytes += g->chunkPadding[ct];
+		stats.slackBytes += g->chunkSlack[ct];
+	}
+	forloop(b, 0, kOccupancyBuckets)
+	{
+		uint32_t end = b + 1 < kOccupancyBuckets ? g->freeBuckets[b + 1] : g->chunkCount;
+		stats.freeChunks[b] = end - g->freeBuckets[b];
 	}
+	return stats;
+}
+
+void world::reserve_chunks(archetype* g, uint32_t count, prefault_mode mode)
+{
+	uint32_t reserved = 0;
+	forloop(i, g->freeBuckets[0], g->chunkCount)
+		reserved += g->chunkCapacity[(int)g->chunks[i]->ct] - g->chunks[i]->count;
+	while (reserved < count)
+	{
+		chunk* c = new_chunk(g, count - reserved);
+		context::prefault(c, c->get_size(), mode);
+		reserved += g->chunkCapacity[(int)c->ct];
+	}
+}
+
+void world::reserve(uint32_t entityCount, const archetype_hint* hints, uint32_t hintCount, prefault_mode mode)
+{
+	auto& datas = ents.datas;
+	auto oldChunkSize = datas.chunkSize;
+	datas.reserve(datas.size + entityCount);
+	forloop(i, oldChunkSize, datas.chunkSize)
+		context::prefault(datas.data[i], chunk_vector_base::kChunkSize, mode);
+
+	//chunks come from the world's resource, only hinted archetypes know their chunk size
+	forloop(i, 0, hintCount)
+		reserve_chunks(get_archetype(hints[i].type), hints[i].count, mode);
 }
 
 bool world::is_a(entity e, const entity_type& type) const noexcept
@@ -2802,7 +3572,7 @@ void world::entities::new_entities(chunk_slice s)
 	uint32_t i = 0;
 	while (i < s.count && free != 0)
 	{
-		uint32_t id = free;
+		entity::underlying_type id = free;
 		free = datas[free].nextFree;
 		entity newE = { id, datas[id].v };
 		dst[i] = newE;
@@ -2818,8 +3588,8 @@ void world::entities::new_entities(chunk_slice s)
 	while (i < s.count)
 	{
 		entity newE(
-			static_cast<uint32_t>(newId),
-			static_cast<uint32_t>(datas[newId].v)
+			static_cast<entity::underlying_type>(newId),
+			static_cast<entity::underlying_type>(datas[newId].v)
 		);
 		dst[i] = newE;
 		datas[newE.id].c = s.c;
@@ -2834,7 +3604,7 @@ void world::entities::new_entities(entity* dst, uint32_t count)
 	uint32_t i = 0;
 	while (i < count && free != 0)
 	{
-		uint32_t id = free;
+		entity::underlying_type id = free;
 		free = datas[free].nextFree;
 		dst[i] = { id, datas[id].v };
 		i++;
@@ -2842,7 +3612,7 @@ void world::entities::new_entities(entity* dst, uint32_t count)
 	if (i == count)
 		return;
 	//fast path
-	uint32_t newId = static_cast<uint32_t>(datas.size);
+	auto newId = static_cast<entity::underlying_type>(datas.size);
 	datas.resize(datas.size + count - i);
 	while (i < count)
 	{
@@ -2855,7 +3625,7 @@ void world::entities::new_entities(entity* dst, uint32_t count)
 entity world::entities::new_prefab(int sizeHint)
 {
 	datas.reserve(datas.size + sizeHint);
-	uint32_t id = (uint32_t)datas.size;
+	auto id = (entity::underlying_type)datas.size;
 	datas.push();
 	return { id, datas[id].v };
 }
@@ -2866,7 +3636,7 @@ entity world::entities::new_entity(int sizeHint)
 		return new_prefab(sizeHint);
 	else
 	{
-		uint32_t id = free;
+		entity::underlying_type id = free;
 		free = datas[free].nextFree;
 		return { id, datas[id].v };
 	}
@@ -2878,11 +3648,11 @@ void world::entities::free_entities(chunk_slice s)
 	forloop(i, 0, s.count - 1)
 	{
 		data& freeData = datas[toFree[i].id];
-		freeData = { nullptr, 0, entity::recycle(freeData.v) };
+		freeData = { nullptr, 0, static_cast<uint32_t>(entity::recycle(freeData.v)) };
 		freeData.nextFree = toFree[i + 1].id;
 	}
 	data& freeData = datas[toFree[s.count - 1].id];
-	freeData = { nullptr, 0, entity::recycle(freeData.v) };
+	freeData = { nullptr, 0, static_cast<uint32_t>(entity::recycle(freeData.v)) };
 	freeData.nextFree = free;
 	free = toFree[0].id;
 	//shrink
@@ -2920,8 +3690,7 @@ void world::entities::clone(entities* dst)
 chunk_vector<matched_archetype> world::query(const archetype_filter& filter) const
 {
 	chunk_vector<matched_archetype> result;
-	auto& cache = get_query_cache(filter);
-	for (auto& type : cache.archetypes)
+	for (auto& type : each_archetype(filter))
 		result.push(type);
 	return result;
 }
@@ -2929,26 +3698,38 @@ chunk_vector<matched_archetype> world::query(const archetype_filter& filter) con
 chunk_vector<chunk*> world::query(const archetype* type, const chunk_filter& filter) const
 {
 	chunk_vector<chunk*> result;
-	auto iter = type->firstChunk;
-	if (filter.changed.length == 0)
-	{
-		while(iter != nullptr)
-		{
-			result.push(iter);
-			iter = iter->next;
-		}
-		return result;
-	}
-
-	while (iter != nullptr)
-	{
-		if (filter.match(type->get_type(), type->timestamps(iter)))
-			result.push(iter);
-		iter = iter->next;
-	}
+	for (auto c : each_chunk(type, filter))
+		result.push(c);
 	return result;
 }
 
+archetype_range world::each_archetype(const archetype_filter& filter) const
+{
+	auto& cache = get_query_cache(filter);
+	auto data = cache.archetypes.data();
+	return { data, data + cache.archetypes.size() };
+}
+
+chunk_range world::each_chunk(const archetype* type, const chunk_filter& filter) const
+{
+	return { type, filter };
+}
+
+void chunk_range::iterator::skip()
+{
+	if (filter->changed.length == 0)
+		return;
+	while (i < type->chunkCount && !filter->match(type->get_type(), type->timestamps(type->chunks[i])))
+		++i;
+}
+
+chunk_range::iterator& chunk_range::iterator::operator++()
+{
+	++i;
+	skip();
+	return *this;
+}
+
 chunk_vector<archetype*> world::get_archetypes()
 {
 	chunk_vector<archetype*> result;
@@ -2994,23 +3775,204 @@ bool archetype_filter::match(const entity_type& t, const typeset& sharedT) const
 
 namespace core::database::chunk_vector_pool
 {
-	void free(void* data)
+	void free(memory_resource_i* resource, void* data)
 	{
-		DotsContext->free(alloc_type::fastbin, data);
-		return;
+		if (resource != nullptr)
+			resource->free(alloc_type::fastbin, data);
+		else
+			DotsContext->free(alloc_type::fastbin, data);
 	}
 
-	void* malloc()
+	void* malloc(memory_resource_i* resource)
 	{
+		if (resource != nullptr)
+			return resource->malloc(alloc_type::fastbin);
 		return DotsContext->malloc(alloc_type::fastbin);
 	}
 }
 namespace chunk_vector_pool = core::database::chunk_vector_pool;
 
+namespace
+{
+	thread_local memory_resource_i* bufferResource = nullptr;
+	thread_local buffer_heap* bufferHeap = nullptr;
+	//owner and size class in front of overflow storage, buffers can outlive their scope
+	struct alignas(alignof(std::max_align_t)) buffer_header
+	{
+		void* owner; //buffer_heap if pooled, memory_resource_i otherwise
+		uint32_t size;
+		uint16_t cls;
+		bool pooled;
+	};
+	constexpr size_t kMinBufferClass = 16;
+	constexpr size_t class_size(size_t cls) { return sizeof(buffer_header) + (kMinBufferClass << cls); }
+}
+
+buffer_heap::~buffer_heap()
+{
+	for (auto& slab : slabs)
+		resource->free(alloc_type::fastbin, slab.base);
+}
+
+void* buffer_heap::alloc(size_t size, uint16_t& cls)
+{
+	allocs.fetch_add(1, std::memory_order_relaxed);
+	cls = 0;
+	while (cls < kClassCount && (kMinBufferClass << cls) < size)
+		cls++;
+	if (cls == kClassCount)
+	{
+		cls = kUnpooled;
+		oversized.fetch_add(1, std::memory_order_relaxed);
+		return resource->buffer_malloc(sizeof(buffer_header) + size);
+	}
+	void* slot;
+	const size_t slotSize = class_size(cls);
+	if (pools[cls].try_dequeue(slot))
+	{
+		reuses.fetch_add(1, std::memory_order_relaxed);
+		pooledBytes.fetch_sub(slotSize, std::memory_order_relaxed);
+		return slot;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	if (top == nullptr || top + slotSize > end)
+	{
+		//tail of old slab is dropped, it is reclaimed with the slab
+		top = (char*)resource->malloc(alloc_type::fastbin);
+		end = top + kFastBinSize;
+		slabs.push_back({ top, 0 });
+	}
+	slabs.back().carved += slotSize;
+	slot = top;
+	top += slotSize;
+	return slot;
+}
+
+void buffer_heap::free(void* slot, uint16_t cls, size_t size)
+{
+	if (cls == kUnpooled)
+		resource->buffer_free(slot, sizeof(buffer_header) + size);
+	else
+	{
+		pooledBytes.fetch_add(class_size(cls), std::memory_order_relaxed);
+		pools[cls].enqueue(slot);
+	}
+}
+
+size_t buffer_heap::trim()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	std::vector<std::pair<void*, uint16_t>> pooled;
+	void* slot;
+	forloop(cls, 0, kClassCount)
+		while (pools[cls].try_dequeue(slot))
+		{
+			pooledBytes.fetch_sub(class_size(cls), std::memory_order_relaxed);
+			pooled.push_back({ slot, (uint16_t)cls });
+		}
+	std::sort(slabs.begin(), slabs.end(), [](const buffer_slab& a, const buffer_slab& b) { return a.base < b.base; });
+	auto slab_of = [&](void* p)
+	{
+		auto iter = std::upper_bound(slabs.begin(), slabs.end(), (char*)p, [](char* p, const buffer_slab& s) { return p < s.base; });
+		return (size_t)(iter - slabs.begin() - 1);
+	};
+	std::vector<size_t> freeBytes(slabs.size(), 0);
+	for (auto& e : pooled)
+		freeBytes[slab_of(e.first)] += class_size(e.second);
+	//the slab being carved stays, every other slab with all slots back is dead
+	std::vector<bool> dead(slabs.size(), false);
+	forloop(i, 0, slabs.size())
+		dead[i] = slabs[i].base != end - kFastBinSize && freeBytes[i] == slabs[i].carved;
+	for (auto& e : pooled)
+		if (!dead[slab_of(e.first)])
+		{
+			pooledBytes.fetch_add(class_size(e.second), std::memory_order_relaxed);
+			pools[e.second].enqueue(e.first);
+		}
+	size_t released = 0;
+	size_t live = 0;
+	forloop(i, 0, slabs.size())
+	{
+		if (dead[i])
+		{
+			resource->free(alloc_type::fastbin, slabs[i].base);
+			released += kFastBinSize;
+		}
+		else
+			slabs[live++] = slabs[i];
+	}
+	slabs.resize(live);
+	//keep the slab being carved last
+	forloop(i, 0, slabs.size())
+		if (slabs[i].base == end - kFastBinSize)
+			std::swap(slabs[i], slabs.back());
+	trimmedAt.store(pooledBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	return released;
+}
+
+void buffer_heap::release()
+{
+	if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		delete this;
+}
+
+memory_scope::memory_scope(memory_resource_i* resource, buffer_heap* heap)
+	:prevResource(bufferResource), prevHeap(bufferHeap)
+{
+	bufferResource = resource;
+	bufferHeap = heap;
+}
+
+memory_scope::~memory_scope()
+{
+	bufferResource = prevResource;
+	bufferHeap = prevHeap;
+}
+
+void* core::database::buffer_malloc(size_t size)
+{
+	buffer_header* header;
+	if (bufferHeap != nullptr)
+	{
+		uint16_t cls;
+		header = (buffer_header*)bufferHeap->alloc(size, cls);
+		header->owner = bufferHeap;
+		header->cls = cls;
+		header->pooled = true;
+		bufferHeap->refs.fetch_add(1, std::memory_order_relaxed);
+		bufferHeap->bytes.fetch_add(size, std::memory_order_relaxed);
+	}
+	else
+	{
+		memory_resource_i* resource = bufferResource ? bufferResource : context::default_resource();
+		header = (buffer_header*)resource->buffer_malloc(sizeof(buffer_header) + size);
+		header->owner = resource;
+		header->pooled = false;
+	}
+	header->size = (uint32_t)size;
+	return header + 1;
+}
+
+void core::database::buffer_free(void* ptr)
+{
+	if (ptr == nullptr)
+		return;
+	auto header = (buffer_header*)ptr - 1;
+	if (header->pooled)
+	{
+		auto heap = (buffer_heap*)header->owner;
+		heap->bytes.fetch_sub(header->size, std::memory_order_relaxed);
+		heap->free(header, header->cls, header->size);
+		heap->release();
+	}
+	else
+		((memory_resource_i*)header->owner)->buffer_free(header, sizeof(buffer_header) + header->size);
+}
+
 void chunk_vector_base::grow()
 {
 	if (data == nullptr)
-		data = (void**)chunk_vector_pool::malloc();
+		data = (void**)chunk_vector_pool::malloc(resource);
 	if(chunkSize * sizeof(void*) >= chunkCapacity)
 	{
 		auto oldCap = chunkCapacity;
@@ -3018,22 +3980,22 @@ void chunk_vector_base::grow()
 		auto newData = ::malloc(chunkCapacity);
 		memcpy(newData, data, oldCap);
 		if (oldCap == kChunkSize)
-			chunk_vector_pool::free(data);
+			chunk_vector_pool::free(resource, data);
 		else
 			::free(data);
 		data = (void**)newData;
 	}
-	data[chunkSize++] = chunk_vector_pool::malloc();
+	data[chunkSize++] = chunk_vector_pool::malloc(resource);
 }
 
 void chunk_vector_base::shrink(size_t n)
 {
 	forloop(i, 0, n)
-		chunk_vector_pool::free(data[--chunkSize]);
+		chunk_vector_pool::free(resource, data[--chunkSize]);
 	if (data && chunkSize == 0)
 	{
 		if (chunkCapacity == kChunkSize)
-			chunk_vector_pool::free(data);
+			chunk_vector_pool::free(resource, data);
 		else
 			::free(data);
 		data = nullptr;
@@ -3071,6 +4033,7 @@ void chunk_vector_base::reset()
 
 chunk_vector_base::chunk_vector_base(chunk_vector_base&& r) noexcept
 {
+	resource = r.resource;
 	data = r.data;
 	size = r.size;
 	chunkSize = r.chunkSize;
@@ -3080,16 +4043,17 @@ chunk_vector_base::chunk_vector_base(chunk_vector_base&& r) noexcept
 
 chunk_vector_base::chunk_vector_base(const chunk_vector_base& r) noexcept
 {
+	resource = r.resource;
 	if (r.chunkSize > 0)
 	{
 		if (r.chunkCapacity == kChunkSize)
-			data = (void**)chunk_vector_pool::malloc();
+			data = (void**)chunk_vector_pool::malloc(resource);
 		else
 			data = (void**)::malloc(r.chunkCapacity);
 	}
 	forloop(i, 0, r.chunkSize)
 	{
-		void* newChunk = chunk_vector_pool::malloc();
+		void* newChunk = chunk_vector_pool::malloc(resource);
 		memcpy(newChunk, r.data[i], kChunkSize);
 		data[i] = newChunk;
 	}
@@ -3106,6 +4070,7 @@ chunk_vector_base::~chunk_vector_base()
 chunk_vector_base& chunk_vector_base::operator=(chunk_vector_base&& r) noexcept
 {
 	reset();
+	resource = r.resource;
 	data = r.data;
 	size = r.size;
 	chunkSize = r.chunkSize;
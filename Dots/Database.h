@@ -5,7 +5,11 @@
 #include <array>
 #include <optional>
 #include <functional>
+#include <chrono>
 #include "DotsRuntime.h"
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
 #define ECS_API
 #include "Type.h"
 
@@ -33,6 +37,108 @@ namespace core
 #endif
 
 		ECS_API builtin_id get_builtin();
+
+		struct buffer_slab
+		{
+			char* base;
+			size_t carved; //bytes handed out as slots
+		};
+
+		/* size-classed pool for buffer overflow storage of a world, slabs come from the world's resource.
+		   trim returns slabs whose slots are all pooled, the rest go with the heap. kept alive by the storage it hands out */
+		struct buffer_heap
+		{
+			static constexpr size_t kClassCount = 10; //16B .. 8KB payloads
+			static constexpr uint16_t kUnpooled = UINT16_MAX;
+			memory_resource_i* resource;
+			std::atomic<size_t> bytes{ 0 };
+			std::atomic<uint32_t> refs{ 1 };
+			std::atomic<uint64_t> allocs{ 0 };
+			std::atomic<uint64_t> reuses{ 0 };
+			std::atomic<uint64_t> oversized{ 0 };
+			moodycamel::ConcurrentQueue<void*> pools[kClassCount];
+			std::mutex lock;
+			std::atomic<size_t> pooledBytes{ 0 };
+			std::atomic<size_t> trimmedAt{ 0 };
+			std::vector<buffer_slab> slabs;
+			char* top = nullptr;
+			char* end = nullptr;
+
+			buffer_heap(memory_resource_i* resource) : resource(resource) {}
+			ECS_API ~buffer_heap();
+			/* return a slot of at least size bytes, cls receives its size class */
+			ECS_API void* alloc(size_t size, uint16_t& cls);
+			ECS_API void free(void* slot, uint16_t cls, size_t size);
+			ECS_API void release();
+			/* hand fully pooled slabs back to the resource, return bytes released */
+			ECS_API size_t trim();
+		};
+
+		struct buffer_stats
+		{
+			size_t inlineBuffers = 0; //buffers still fitting chunk storage
+			size_t overflowBuffers = 0;
+			size_t overflowBytes = 0;
+			uint64_t heapAllocs = 0;
+			uint64_t heapReuses = 0; //served from a pooled slot
+			uint64_t heapOversized = 0; //too large for size classes
+			size_t slabBytes = 0;
+		};
+
+		//upper bound of inline storage picked by world::adapt_buffers, keeps chunks dense
+		constexpr uint32_t kMaxAdaptiveInlineSize = 1024;
+
+		/* route buffer overflow allocations of calling thread to a resource */
+		struct memory_scope
+		{
+			memory_resource_i* prevResource;
+			buffer_heap* prevHeap;
+			ECS_API memory_scope(memory_resource_i* resource, buffer_heap* heap = nullptr);
+			memory_scope(const memory_scope&) = delete;
+			ECS_API ~memory_scope();
+		};
+
+		//chunks with free slots are grouped by fill rate, allocation prefers the fullest group
+		constexpr uint32_t kOccupancyBuckets = 4;
+
+		struct archetype_stats
+		{
+			uint32_t chunks = 0;
+			uint32_t freeChunks[kOccupancyBuckets] = {}; //chunks with free slots per bucket, fullest first
+			uint32_t entities = 0;
+			uint64_t capacity = 0; //entity slots of all chunks
+			//wasted bytes of all chunks, alignment padding between columns and unused tails
+			size_t paddingBytes = 0;
+			size_t slackBytes = 0;
+			//live entities / capacity, low values mean fragmented chunks
+			float occupancy() const { return capacity == 0 ? 1.f : float(entities) / capacity; }
+		};
+
+		//limits of one world::defragment call, zero for unlimited
+		struct defrag_budget
+		{
+			size_t bytes = 0;
+			std::chrono::microseconds time{ 0 };
+		};
+
+		struct world_memory_stats
+		{
+			size_t chunkBytes[kBinCount] = {};
+			uint32_t chunks[kBinCount] = {};
+			size_t entityBytes = 0; //entity table segments
+			size_t bufferBytes = 0; //buffer overflow storage allocated by the world
+			size_t queryBytes = 0; //query caches
+			uint64_t budgetFailures = 0;
+			uint64_t defragBytes = 0; //moved by world::defragment
+			uint64_t defragChunks = 0; //released by world::defragment
+			size_t total() const
+			{
+				size_t result = entityBytes + bufferBytes + queryBytes;
+				for (size_t i = 0; i < kBinCount; ++i)
+					result += chunkBytes[i];
+				return result;
+			}
+		};
 #include "ChunkVector.h"
 #include "Buffer.h"
 		template<class T>
@@ -84,6 +190,12 @@ namespace core
 				: c(c), start(s), count(count) {}
 		};
 
+		struct archetype_hint
+		{
+			entity_type type;
+			uint32_t count;
+		};
+
 		struct managed_func
 		{
 			void(*copy)(char* dst, const char* src, size_t n) = nullptr;
@@ -91,26 +203,110 @@ namespace core
 			void(*destructor)(char* data, size_t n) = nullptr;
 		};
 
+		/* fixed width component bitset by type id, overflow when an id doesn't fit.
+		   matching with it is only valid when neither side overflows */
+		struct type_signature
+		{
+			static constexpr uint32_t kBits = 256;
+			uint64_t words[kBits / 64] = {};
+			bool overflow = false;
+
+			void add(type_index type) noexcept
+			{
+				auto id = type.index();
+				if (id >= kBits)
+					overflow = true;
+				else
+					words[id / 64] |= uint64_t(1) << (id % 64);
+			}
+			void add(const typeset& types) noexcept
+			{
+				for (tsize_t i = 0; i < types.length; ++i)
+					add(types[i]);
+			}
+			type_signature operator|(const type_signature& other) const noexcept
+			{
+				type_signature r;
+				for (uint32_t i = 0; i < kBits / 64; ++i)
+					r.words[i] = words[i] | other.words[i];
+				r.overflow = overflow || other.overflow;
+				return r;
+			}
+			//(this & s) == s
+			bool all(const type_signature& s) const noexcept
+			{
+#if defined(__AVX2__)
+				__m256i a = _mm256_loadu_si256((const __m256i*)words);
+				__m256i b = _mm256_loadu_si256((const __m256i*)s.words);
+				return _mm256_testc_si256(a, b) != 0;
+#elif defined(__SSE4_1__)
+				__m128i a0 = _mm_loadu_si128((const __m128i*)words), a1 = _mm_loadu_si128((const __m128i*)words + 1);
+				__m128i b0 = _mm_loadu_si128((const __m128i*)s.words), b1 = _mm_loadu_si128((const __m128i*)s.words + 1);
+				return _mm_testc_si128(a0, b0) && _mm_testc_si128(a1, b1);
+#else
+				uint64_t missing = 0;
+				for (uint32_t i = 0; i < kBits / 64; ++i)
+					missing |= s.words[i] & ~words[i];
+				return missing == 0;
+#endif
+			}
+			//(this & s) != 0
+			bool any(const type_signature& s) const noexcept
+			{
+#if defined(__AVX2__)
+				__m256i a = _mm256_loadu_si256((const __m256i*)words);
+				__m256i b = _mm256_loadu_si256((const __m256i*)s.words);
+				return _mm256_testz_si256(a, b) == 0;
+#elif defined(__SSE4_1__)
+				__m128i a0 = _mm_loadu_si128((const __m128i*)words), a1 = _mm_loadu_si128((const __m128i*)words + 1);
+				__m128i b0 = _mm_loadu_si128((const __m128i*)s.words), b1 = _mm_loadu_si128((const __m128i*)s.words + 1);
+				return !(_mm_testz_si128(a0, b0) && _mm_testz_si128(a1, b1));
+#else
+				uint64_t common = 0;
+				for (uint32_t i = 0; i < kBits / 64; ++i)
+					common |= s.words[i] & words[i];
+				return common != 0;
+#endif
+			}
+		};
+
+		struct archetype_edge;
+		struct cast_plan;
+
+
 		struct ECS_API archetype
 		{
-			chunk* firstChunk;
-			chunk* lastChunk;
-			chunk* firstFree;
+			chunk** chunks; //full chunks first, then chunks with free slots from fullest bucket to emptiest
+			uint32_t chunkCount;
+			uint32_t chunkSlots; //capacity of chunks
+			uint32_t freeBuckets[kOccupancyBuckets]; //start of each bucket in chunks, freeBuckets[0] is the first non-full chunk
 			tsize_t componentCount;
 			tsize_t firstTag;
 			tsize_t firstManaged;
 			tsize_t metaCount;
 			tsize_t firstBuffer;
-			uint16_t chunkCount;
+			size_t chunkBytes;
 			uint32_t chunkCapacity[3];
+			uint32_t chunkPadding[3]; //bytes per chunk lost to column alignment
+			uint32_t chunkSlack[3]; //bytes per chunk left after the last column
+			alloc_type chunkClass; //bin of new chunks, promoted as the archetype grows
+			uint16_t grown; //chunks created in chunkClass
 			uint32_t timestamp;
 			uint32_t size;
 			uint32_t entitySize;
+			size_t hash; //of get_type(), key of world::archetypes
+			type_signature signature; //owned components
 			type_index* types;
 			uint32_t* offsets[3];
 			uint16_t* sizes;
 			entity* metatypes;
 			managed_func* managedFuncs;
+			tsize_t* lookup; //type hash -> column, open addressing
+			archetype_edge* edges; //cached get_casted results
+			cast_plan* plans; //cached chunk::cast ops by destination
+			//transitions of other archetypes ending here, dropped with this archetype
+			archetype_edge* edgesIn;
+			cast_plan* plansIn;
 
 			bool disabled;
 			bool cleaning;
@@ -125,10 +321,36 @@ namespace core
 			uint16_t sizes[firstTag];
 			entity metatypes[metaCount];
 			managed_func managedFuncs[firstTag - firstManaged]
+			tsize_t lookup[1 << lookup_bits(componentCount)]
 			*/
 			inline char* data() noexcept { return (char*)(this + 1); };
 			uint32_t* timestamps(chunk* c) const  noexcept;
-			tsize_t index(type_index type) const  noexcept;
+			//load factor <= 0.5, at least 2 slots
+			static constexpr uint32_t lookup_bits(tsize_t count) noexcept
+			{
+				uint32_t bits = 1;
+				while ((1u << bits) < 2u * count)
+					++bits;
+				return bits;
+			}
+			static constexpr uint32_t lookup_hash(type_index type, uint32_t bits) noexcept
+			{
+				return (uint32_t(type) * 0x9E3779B1u) >> (32 - bits);
+			}
+			inline tsize_t index(type_index type) const noexcept
+			{
+				const uint32_t bits = lookup_bits(componentCount);
+				const uint32_t slotMask = (1u << bits) - 1;
+				uint32_t h = lookup_hash(type, bits);
+				while (true)
+				{
+					tsize_t id = lookup[h];
+					if (id == tsize_t(-1) || types[id] == type)
+						return id;
+					h = (h + 1) & slotMask;
+				}
+			}
+			void build_lookup() noexcept;
 			mask get_mask(const typeset& subtype) noexcept;
 
 			inline entity_type get_type() const;
@@ -180,6 +402,113 @@ namespace core
 			}
 		};
 
+		/* hash-consed entity type, equal types share one entry so they compare by id */
+		struct interned_type
+		{
+			entity_type type;
+			size_t hash;
+			uint32_t id;
+		};
+
+		struct interned_diff
+		{
+			const interned_type* extend;
+			const interned_type* shrink;
+			uint32_t id;
+
+			type_diff get() const { return { extend->type, shrink->type }; }
+		};
+
+		/* interning table for entity types and type diffs, with memoized merge results.
+		   entries are stable until clear, not thread safe */
+		class ECS_API type_table
+		{
+			std::unordered_map<entity_type, interned_type*, entity_type::hash> types;
+			std::vector<interned_type*> typeList;
+			std::unordered_map<uint64_t, interned_diff*> diffs;
+			std::vector<interned_diff*> diffList;
+			std::unordered_map<uint64_t, const interned_type*> applied;
+			std::unordered_map<uint64_t, const interned_diff*> merged;
+			std::vector<char> scratch;
+
+			char* get_scratch(size_t size);
+		public:
+			type_table() = default;
+			type_table(const type_table&) = delete;
+			type_table& operator=(const type_table&) = delete;
+			~type_table();
+
+			const interned_type* intern(const entity_type& type);
+			const interned_diff* intern(const type_diff& diff);
+			/* type with diff.shrink removed then diff.extend added */
+			const interned_type* apply(const interned_type* type, const interned_diff* diff);
+			/* same as type_diff::merge */
+			const interned_diff* merge(const interned_diff* a, const interned_diff* b);
+			uint32_t size() const { return (uint32_t)typeList.size(); }
+			void clear();
+		};
+
+		/* transition from an archetype by a type_diff, the diff is stored inline after the edge.
+		   linked in the source's edges and the destination's edgesIn */
+		struct archetype_edge
+		{
+			archetype_edge* next;
+			archetype_edge** prev;
+			archetype_edge* nextIn;
+			archetype_edge** prevIn;
+			archetype* dst;
+			size_t hash; //of diff and inst
+			type_diff diff;
+			bool inst;
+		};
+
+		/* column ops of chunk::cast between two archetypes, cached on the source archetype */
+		struct cast_plan
+		{
+			enum op_type : uint8_t
+			{
+				op_none,
+				op_copy,
+				op_zero,
+				op_construct_buffer,
+				op_destruct_buffer,
+				op_construct,
+				op_destruct
+			};
+			struct op
+			{
+				op_type type;
+				tsize_t srcI;
+				tsize_t dstI;
+				uint16_t size;
+			};
+			struct bit_remap
+			{
+				tsize_t src;
+				tsize_t dst;
+			};
+			cast_plan* next;
+			cast_plan** prev;
+			cast_plan* nextIn;
+			cast_plan** prevIn;
+			archetype* dst;
+			tsize_t opCount;
+			tsize_t remapCount;
+			tsize_t remapOffset;
+			tsize_t srcMaskId;
+			tsize_t dstMaskId;
+			mask newBits; //components added by the cast start enabled
+			/*
+			op ops[opCount];
+			bit_remap remaps[remapCount];
+			*/
+			op* ops() noexcept { return (op*)(this + 1); }
+			const op* ops() const noexcept { return (const op*)(this + 1); }
+			bit_remap* remaps() noexcept { return (bit_remap*)(ops() + remapOffset); }
+			const bit_remap* remaps() const noexcept { return (const bit_remap*)(ops() + remapOffset); }
+			static cast_plan* build(archetype* src, archetype* dst);
+		};
+
 		struct batch_iter
 		{
 			const entity* es;
@@ -207,6 +536,42 @@ namespace core
 			iterator_end end() const { return {}; }
 		};
 
+		/* matched archetypes of a cached query, iterated in place.
+		   valid until the next archetype is created or destroyed */
+		struct archetype_range
+		{
+			const matched_archetype* first;
+			const matched_archetype* last;
+			const matched_archetype* begin() const { return first; }
+			const matched_archetype* end() const { return last; }
+			size_t size() const { return last - first; }
+		};
+
+		/* chunks of an archetype passing a chunk_filter, walks the chunk list in place.
+		   valid until the next structural change of the archetype */
+		struct chunk_range
+		{
+			const archetype* type;
+			chunk_filter filter;
+			struct iterator_end {};
+			struct iterator
+			{
+				const archetype* type;
+				const chunk_filter* filter;
+				uint32_t i;
+				ECS_API void skip();
+				ECS_API iterator& operator++();
+				chunk* operator*() { return type->chunks[i]; }
+				bool operator!=(const iterator_end& other) { return i < type->chunkCount; }
+			};
+			iterator begin() const { iterator iter{ type, &filter, 0 }; iter.skip(); return iter; }
+			iterator_end end() const { return {}; }
+		};
+
+		/* layout of world and entity streams, data of another version is rejected.
+		   2: buffers are written as size + content */
+		constexpr uint32_t kSerializeVersion = 2;
+
 		class world
 		{
 		public:
@@ -218,13 +583,13 @@ namespace core
 					union
 					{
 						chunk* c;
-						uint32_t nextFree;
+						entity::underlying_type nextFree;
 					};
 					uint32_t i : 24;
-					uint32_t v : 8;
+					uint32_t v : entity::version_bits;
 				};
 				chunk_vector<data> datas;
-				uint32_t free = 0;
+				entity::underlying_type free = 0;
 				void clear();
 				void new_entities(chunk_slice slice);
 				void new_entities(entity* dst, uint32_t count);
@@ -245,40 +610,88 @@ namespace core
 				//TODO: use fixed_vector
 				std::vector<matched_archetype> archetypes;
 				using iterator = std::vector<matched_archetype>::iterator;
+				uint32_t visit = 0; //dedup stamp of update_queries
+				//precomputed filter bitsets
+				type_signature all, any, owned, shared, noneOwned, noneShared;
+				bool overflow = false;
 			};
 
-			using queries_t = std::unordered_map<archetype_filter, query_cache, archetype_filter::hash>;
-			using archetypes_t = std::unordered_map<entity_type, archetype*, entity_type::hash>;
+			//position of an archetype in a query cache
+			struct query_slot
+			{
+				query_cache* cache;
+				uint32_t index;
+			};
+
+			struct type_hash
+			{
+				size_t operator()(type_index type) const noexcept { return (index_t)type; }
+			};
+
+			struct archetype_hash
+			{
+				size_t operator()(archetype* g) const noexcept { return hash_array(&g, 1); }
+			};
+
+			using query_key = hashed_key<archetype_filter>;
+			using archetype_key = hashed_key<entity_type>;
+			using queries_t = flat_map<query_key, std::unique_ptr<query_cache>, query_key::hasher>;
+			using archetypes_t = flat_map<archetype_key, archetype*, archetype_key::hasher>;
 
 			archetypes_t archetypes;
 			mutable queries_t queries;
+			//component type -> caches that require it, a cache is anchored on one type or on every any type
+			mutable flat_map<type_index, std::vector<query_cache*>, type_hash> queryIndex;
+			//caches without a required component, checked for every archetype
+			mutable std::vector<query_cache*> unanchoredQueries;
+			//archetype -> caches containing it
+			mutable flat_map<archetype*, std::vector<query_slot>, archetype_hash> archetypeQueries;
+			uint32_t queryVisit = 0;
+			uint32_t defragCursor = 0; //archetype defragment resumes from
 			entities ents;
 			uint32_t* typeTimestamps;
 			uint32_t typeCapacity;
+			memory_resource_i* resource;
+			buffer_heap* bufferHeap;
+			//running totals, query bytes also grow from const lookups
+			mutable world_memory_stats memory;
+			uint16_t* bufferSizes; //per type size of adaptive buffers, 0 for registered size
 
 			//query behavior
 			query_cache& get_query_cache(const archetype_filter& f) const;
 			void update_queries(archetype* g, bool add);
+			void index_query(query_cache* cache) const;
+			void add_to_query(query_cache* cache, archetype* g) const;
+			static void sign_query(query_cache* cache);
+			static bool match_query(const query_cache& cache, archetype* g, const typeset& sharedT, const type_signature& sharedSig);
 			archetype_filter cache_query(const archetype_filter& type);
 
 			//archetype-chunk behavior
-			static void remove(chunk*& head, chunk*& tail, chunk* toremove);
+			static void swap_chunks(archetype* g, uint32_t a, uint32_t b);
 			void add_chunk(archetype* g, chunk* c);
 			void remove_chunk(archetype* g, chunk* c);
-			static void mark_free(archetype* g, chunk* c);
-			static void unmark_free(archetype* g, chunk* c);
-			static chunk* malloc_chunk(alloc_type type);
+			static void rebucket_chunk(archetype* g, chunk* c, uint32_t region);
+			static void rebuild_buckets(archetype* g);
+			chunk* malloc_chunk(alloc_type type);
 			chunk* new_chunk(archetype*, uint32_t hint);
+			alloc_type pick_chunk_class(archetype*, uint32_t hint);
+			void upgrade_chunk_class(archetype*);
 			void destroy_chunk(archetype*, chunk*);
 			void recycle_chunk(chunk*);
 			void resize_chunk(chunk*, uint32_t);
 			void merge_chunks(archetype*);
+			static chunk* defrag_source(archetype*);
+			archetype* next_defrag_target();
+			void reserve_chunks(archetype*, uint32_t count, prefault_mode mode);
+			bool check_budget(archetype*, uint32_t count);
 
 			//archetype behavior
 			archetype* get_archetype(const entity_type&);
 			archetype* construct_archetype(const entity_type& key);
 			void add_archetype(archetype*);
 			void structural_change(archetype* g, chunk* c);
+			archetype* relayout(archetype* g);
+			uint32_t relayout_buffer(type_index type, uint16_t size);
 
 			//entity behavior
 			chunk_slice allocate_slice(archetype*, uint32_t = 1);
@@ -286,6 +699,7 @@ namespace core
 			chunk_vector<chunk_slice> cast_slice(chunk_slice, archetype*);
 
 			//serialize behavior
+			static bool archive_version(serializer_i* s);
 			static void serialize_archetype(archetype* g, serializer_i* s);
 			archetype* deserialize_archetype(serializer_i* s, patcher_i* patcher, bool createNew);
 			void serialize_slice(const chunk_slice& slice, serializer_i* s);
@@ -309,10 +723,14 @@ namespace core
 			void estimate_shared_size(tsize_t& size, archetype* t) const;
 			void get_shared_type(typeset& type, archetype* t, typeset& buffer) const;
 			void release_reference(archetype* g);
+			static void free_edges(archetype* g);
+			static void free_archetype(archetype* g);
+			static const cast_plan* get_cast_plan(archetype* src, archetype* dst);
+			archetype* build_casted(archetype* g, type_diff diff, bool inst);
 
 			friend chunk;
 		public:
-			ECS_API world(uint32_t typeCapacity = 4096u);
+			ECS_API world(uint32_t typeCapacity = 4096u, memory_resource_i* resource = nullptr);
 			ECS_API world(const world& other/*todo: ,archetype_filter*/);
 			ECS_API world(world&& other);
 			ECS_API ~world();
@@ -353,6 +771,8 @@ namespace core
 			//query
 			ECS_API chunk_vector<matched_archetype> query(const archetype_filter& filter) const;
 			ECS_API chunk_vector<chunk*> query(const archetype*, const chunk_filter& filter = {}) const;
+			ECS_API archetype_range each_archetype(const archetype_filter& filter) const;
+			ECS_API chunk_range each_chunk(const archetype*, const chunk_filter& filter = {}) const;
 			ECS_API chunk_vector<archetype*> get_archetypes();
 
 			//query (entity)
@@ -374,6 +794,7 @@ namespace core
 			//entity/group serialize 
 			ECS_API chunk_vector<entity> gather_reference(entity);
 			ECS_API void serialize(serializer_i* s, entity);
+			/* return NullEntity if the stream is of another version */
 			ECS_API entity deserialize(serializer_i* s, patcher_i* patcher);
 
 			//query (chunk_slice)
@@ -398,24 +819,53 @@ namespace core
 			ECS_API void patch_chunk(chunk_slice c, patcher_i* patcher);
 			//serialize
 			ECS_API void serialize(serializer_i* s);
-			ECS_API void deserialize(serializer_i* s);
+			/* return false and leave the world empty if the stream is of another version */
+			ECS_API bool deserialize(serializer_i* s);
 			//clear
 			ECS_API void clear();
 			ECS_API void gc_meta();
+			/* note: runs adapt_buffers, relayouted archetypes are freed. archetype* and
+			   each_archetype ranges held across the call are invalidated */
 			ECS_API void merge_chunks();
+			/* incremental compaction, drain the emptiest chunks into fuller ones and release them.
+			   stops when the budget runs out and resumes from that archetype on the next call, return bytes moved */
+			ECS_API size_t defragment(const defrag_budget& budget = {});
+			ECS_API size_t defragment(archetype* g, const defrag_budget& budget = {});
+			/* move adaptive buffers of every archetype to a new inline capacity(in elements) */
+			ECS_API void set_buffer_capacity(type_index type, uint32_t capacity);
+			/* size inline storage of adaptive buffers to fit the given fraction of current buffers,
+			   relayout archetypes that changed, return the count of them. called by merge_chunks */
+			ECS_API uint32_t adapt_buffers(float coverage = 0.9f);
+			//memory
+			memory_resource_i* get_resource() const noexcept { return resource; }
+			ECS_API world_memory_stats get_memory_stats() const;
+			ECS_API buffer_stats get_buffer_stats() const;
+			/* route buffer growth of calling thread to this world's heap, e.g. around a system */
+			memory_scope make_scope() const { return { resource, bufferHeap }; }
+			size_t get_memory(const archetype* g) const noexcept { return g->chunkBytes; }
+			ECS_API archetype_stats get_archetype_stats(const archetype* g) const;
+			/* bytes the world may hold, 0 for unlimited. allocate/instantiate that would exceed it
+			   call on_budget_exceeded (return true to retry once) and return empty if still over budget */
+			size_t budget = 0;
+			std::function<bool(world&, size_t required)> on_budget_exceeded;
+			/* pre-size entity storage and pre-create chunks for hinted archetypes.
+			   unhinted entities only reserve entity storage, use context::prewarm to pool shared bins */
+			ECS_API void reserve(uint32_t entityCount, const archetype_hint* hints = nullptr, uint32_t hintCount = 0, prefault_mode mode = prefault_mode::none);
 			//query
-			uint32_t timestamp;
+			uint32_t timestamp = 0;
 			ECS_API int get_timestamp() { return timestamp; }
 			ECS_API void inc_timestamp() { ++timestamp; }
 
 			std::function<void(archetype*, bool)> on_archetype_update;
+			//called before defragment moves entities of an archetype
+			std::function<void(archetype*)> on_defragment;
 		};
 
 		struct chunk
 		{
 		public:
-			chunk *next, *prev;
 			archetype* type;
+			uint32_t index; //in type->chunks
 			uint32_t count;
 			alloc_type ct;
 			/*
@@ -432,13 +882,12 @@ namespace core
 			static void destruct(chunk_slice) noexcept;
 			static void move(chunk_slice dst, tsize_t srcIndex) noexcept;
 			static void move(chunk_slice dst, const chunk* src, uint32_t srcIndex) noexcept;
-			static void cast(chunk_slice dst, chunk* src, tsize_t srcIndex, bool destruct = true) noexcept;
+			static void cast(chunk_slice dst, chunk* src, tsize_t srcIndex, const cast_plan* plan, bool destruct = true) noexcept;
 			static void duplicate(chunk_slice dst, const chunk* src, tsize_t srcIndex) noexcept;
+			static void relayout(chunk_slice dst, chunk* src, uint32_t srcIndex) noexcept;
 			static void patch(chunk_slice s, patcher_i* patcher) noexcept;
 			static void serialize(chunk_slice s, serializer_i *stream, bool withEntities = true);
 			size_t get_size();
-			void link(chunk*) noexcept;
-			void unlink() noexcept;
 			void clone(chunk*) noexcept;
 			char* data() { return (char*)(this + 1); }
 			const char* data() const { return (char*)(this + 1); }
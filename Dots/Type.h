@@ -61,6 +61,32 @@ namespace core
 
 		inline constexpr entity_type EmptyType;
 
+		/* map key carrying its hash, lookups and rehashing never hash the content again */
+		template<class T>
+		struct hashed_key
+		{
+			T value;
+			size_t hash;
+
+			hashed_key(const T& value)
+				:value(value), hash(typename T::hash{}(value)) {}
+			hashed_key(const T& value, size_t hash)
+				:value(value), hash(hash) {}
+
+			bool operator==(const hashed_key& other) const
+			{
+				return hash == other.hash && value == other.value;
+			}
+
+			struct hasher
+			{
+				size_t operator()(const hashed_key& key) const noexcept
+				{
+					return key.hash;
+				}
+			};
+		};
+
 		struct archetype_filter
 		{
 			entity_type all;
@@ -1,4 +1,14 @@
 #include "DotsRuntime.h"
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <malloc.h>
+#elif !defined(__EMSCRIPTEN__) && (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h>
+#define DOTS_ARENA_MMAP
+#endif
 
 using namespace core::database;
 
@@ -52,7 +62,6 @@ context::context()
 		guid_id = register_type(desc);
 	}
 #endif
-	stack.init(10000);
 }
 
 context& context::get()
@@ -61,44 +70,550 @@ context& context::get()
 	return instance;
 }
 
+scratch_arena& context::scratch()
+{
+	thread_local scratch_arena arena;
+	return arena;
+}
+
+void* scratch_arena::grow(size_t size, size_t align)
+{
+	size_t need = sizeof(block) + size + align;
+	block* b = nullptr;
+	if (spare != nullptr && spare->size >= need)
+	{
+		b = spare;
+		spare = nullptr;
+	}
+	else
+	{
+		size_t blockSize = std::max(need, current ? current->size * 2 : kScratchBlockSize);
+		b = (block*)::malloc(blockSize);
+		b->size = blockSize;
+	}
+	b->prev = current;
+	current = b;
+	top = (char*)(b + 1);
+	end = (char*)b + b->size;
+	return alloc(size, align);
+}
+
+void scratch_arena::rewind(marker m)
+{
+	while (current != m.b)
+	{
+		block* prev = current->prev;
+		if (spare == nullptr || current->size > spare->size)
+			std::swap(spare, current);
+		::free(current);
+		current = prev;
+	}
+	top = m.top;
+	end = current ? (char*)current + current->size : nullptr;
+}
+
+scratch_arena::~scratch_arena()
+{
+	reset();
+	::free(spare);
+}
+
+namespace
+{
+	constexpr size_t kMagazineSizes[kBinCount] = { kSmallBinMagazine, kFastBinMagazine, kLargeBinMagazine };
+	constexpr size_t kMaxMagazineSize = std::max({ kSmallBinMagazine, kFastBinMagazine, kLargeBinMagazine });
+	constexpr size_t kPageSize = 4096;
+
+	//bin blocks outside the arena, aligned to kChunkAlignment
+	void* block_malloc(size_t size)
+	{
+#if defined(_WIN32)
+		return _aligned_malloc(size, kChunkAlignment);
+#else
+		return ::aligned_alloc(kChunkAlignment, (size + kChunkAlignment - 1) / kChunkAlignment * kChunkAlignment);
+#endif
+	}
+
+	void block_free(void* block)
+	{
+#if defined(_WIN32)
+		_aligned_free(block);
+#else
+		::free(block);
+#endif
+	}
+
+	struct magazine
+	{
+		void* blocks[kMaxMagazineSize];
+		size_t count = 0;
+		//thread local counters, published on slow path
+		uint64_t allocs = 0;
+		uint64_t frees = 0;
+		uint64_t hits = 0;
+	};
+
+	struct thread_cache
+	{
+		magazine bins[kBinCount];
+		~thread_cache()
+		{
+			context::get().flush_thread_cache();
+		}
+	};
+
+	thread_local thread_cache tcache;
+
+	moodycamel::ConcurrentQueue<void*>& get_bin(context& ctx, alloc_type type)
+	{
+		switch (type)
+		{
+		case alloc_type::smallbin:
+			return ctx.smallbin;
+		case alloc_type::largebin:
+			return ctx.largebin;
+		default:
+			return ctx.fastbin;
+		}
+	}
+
+	void publish(context::bin_counters& counter, magazine& m)
+	{
+		counter.allocs.fetch_add(m.allocs, std::memory_order_relaxed);
+		counter.frees.fetch_add(m.frees, std::memory_order_relaxed);
+		counter.magazineHits.fetch_add(m.hits, std::memory_order_relaxed);
+		m.allocs = m.frees = m.hits = 0;
+	}
+
+	//give a pooled block back to the system, return false if it has to stay pooled
+	bool discard(context& ctx, alloc_type type, void* block)
+	{
+		const size_t size = ctx.binSizes[(int)type];
+		auto& counter = ctx.counters[(int)type];
+		if (ctx.arena.owns(block))
+		{
+			//madvise works on whole pages, sub page blocks would drop their neighbours
+			if (size < kPageSize)
+			{
+				ctx.arena.spill[(int)type].enqueue(block);
+				return false;
+			}
+#if defined(_WIN32)
+			VirtualAlloc(block, size, MEM_RESET, PAGE_READWRITE);
+#elif defined(DOTS_ARENA_MMAP)
+			madvise(block, size, MADV_DONTNEED);
+#endif
+			ctx.arena.released[(int)type].enqueue(block);
+		}
+		else
+		{
+			counter.sysFrees.fetch_add(1, std::memory_order_relaxed);
+			block_free(block);
+		}
+		counter.trimmed.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	size_t decay(context& ctx)
+	{
+		if (!ctx.policyEnabled.load(std::memory_order_acquire))
+			return 0;
+		const auto& policy = ctx.policy;
+		if (policy.decayInterval.count() == 0)
+			return 0;
+		using namespace std::chrono;
+		int64_t now = duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+		int64_t last = ctx.lastDecay.load(std::memory_order_relaxed);
+		//only one thread runs a decay step per interval
+		if (now - last < policy.decayInterval.count() || !ctx.lastDecay.compare_exchange_strong(last, now))
+			return 0;
+		size_t released = 0;
+		for (size_t i = 0; i < kBinCount; ++i)
+		{
+			size_t pooled = get_bin(ctx, (alloc_type)i).size_approx() + ctx.arena.spill[i].size_approx();
+			size_t low = policy.lowWater[i];
+			if (pooled > low)
+				released += ctx.trim((alloc_type)i, pooled - (size_t)((pooled - low) * policy.decayRate));
+		}
+		return released;
+	}
+
+	void release(context& ctx, alloc_type type, void** blocks, size_t count)
+	{
+		auto& bin = get_bin(ctx, type);
+		if (ctx.policyEnabled.load(std::memory_order_acquire))
+		{
+			size_t pooled = bin.size_approx();
+			size_t highWater = ctx.policy.highWater[(int)type];
+			size_t room = pooled < highWater ? highWater - pooled : 0;
+			for (size_t i = room; i < count; ++i)
+				discard(ctx, type, blocks[i]);
+			count = std::min(count, room);
+			if (count == 0)
+				return;
+		}
+		if (bin.try_enqueue_bulk(blocks, count))
+			return;
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (bin.try_enqueue(blocks[i]))
+				continue;
+			if (ctx.arena.owns(blocks[i]))
+				ctx.arena.spill[(int)type].enqueue(blocks[i]);
+			else
+			{
+				ctx.counters[(int)type].sysFrees.fetch_add(1, std::memory_order_relaxed);
+				block_free(blocks[i]);
+			}
+		}
+	}
+}
+
+bool chunk_arena::owns(const void* ptr) const noexcept
+{
+	size_t count = regionCount.load(std::memory_order_acquire);
+	for (size_t i = 0; i < count; ++i)
+		if (ptr >= regions[i].base && ptr < regions[i].base + regions[i].size)
+			return true;
+	return false;
+}
+
+bool chunk_arena::map_region()
+{
+	size_t count = regionCount.load(std::memory_order_relaxed);
+	if (count == kMaxArenaRegions)
+		return false;
+	size_t size = (regionSize + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+	region r{ nullptr, size, false, false };
+#if defined(_WIN32)
+	if (hugePages)
+	{
+		//requires SeLockMemoryPrivilege, fail silently otherwise
+		size_t largePage = GetLargePageMinimum();
+		if (largePage != 0)
+		{
+			size_t largeSize = (size + largePage - 1) / largePage * largePage;
+			r.base = (char*)VirtualAlloc(nullptr, largeSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (r.base != nullptr)
+			{
+				r.size = largeSize;
+				r.huge = true;
+			}
+		}
+	}
+	if (r.base == nullptr)
+		r.base = (char*)VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#elif defined(DOTS_ARENA_MMAP)
+#ifdef MAP_HUGETLB
+	if (hugePages)
+	{
+		void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			r.base = (char*)p;
+			r.huge = true;
+		}
+	}
+#endif
+	if (r.base == nullptr)
+	{
+		//over reserve and trim so the region starts on a huge page boundary
+		void* p = mmap(nullptr, size + kHugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return false;
+		size_t head = (kHugePageSize - (size_t)p % kHugePageSize) % kHugePageSize;
+		r.base = (char*)p + head;
+		if (head != 0)
+			munmap(p, head);
+		if (head != kHugePageSize)
+			munmap(r.base + size, kHugePageSize - head);
+#ifdef MADV_HUGEPAGE
+		if (hugePages)
+			r.advised = madvise(r.base, size, MADV_HUGEPAGE) == 0;
+#endif
+	}
+#endif
+	if (r.base == nullptr)
+		return false;
+	regions[count] = r;
+	top = 0;
+	regionCount.store(count + 1, std::memory_order_release);
+	return true;
+}
+
+size_t chunk_arena::carve(alloc_type type, size_t size, void** blocks, size_t count)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	size_t n = 0;
+	while (n < count)
+	{
+		size_t rc = regionCount.load(std::memory_order_relaxed);
+		if (rc > 0)
+		{
+			const region& r = regions[rc - 1];
+			//keep blocks aligned to their own size inside the region
+			size_t offset = (top + size - 1) / size * size;
+			if (offset + size <= r.size)
+			{
+				blocks[n++] = r.base + offset;
+				top = offset + size;
+				carved[(int)type].fetch_add(1, std::memory_order_relaxed);
+				if (r.huge)
+					hugeCarved[(int)type].fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+		}
+		if (!map_region())
+			break;
+	}
+	return n;
+}
+
 void context::free(alloc_type type, void* data)
 {
-	switch (type)
+	auto& m = tcache.bins[(int)type];
+	const size_t capacity = kMagazineSizes[(int)type];
+	m.frees++;
+	if (m.count == capacity)
 	{
-	case alloc_type::fastbin:
-		if (!fastbin.try_enqueue(data))
-			::free(data);
-		break;
-	case alloc_type::smallbin:
-		if (!smallbin.try_enqueue(data))
-			::free(data);
-		break;
-	case alloc_type::largebin:
-		if (!largebin.try_enqueue(data))
-			::free(data);
-		break;
+		//flush older half to shared bin
+		const size_t toFlush = capacity / 2;
+		auto& counter = counters[(int)type];
+		publish(counter, m);
+		counter.flushes.fetch_add(1, std::memory_order_relaxed);
+		release(*this, type, m.blocks, toFlush);
+		m.count -= toFlush;
+		std::copy(m.blocks + toFlush, m.blocks + toFlush + m.count, m.blocks);
+		decay(*this);
 	}
+	m.blocks[m.count++] = data;
 }
 
 void* context::malloc(alloc_type type)
 {
-	void* result = nullptr;
-	switch (type)
+	auto& m = tcache.bins[(int)type];
+	m.allocs++;
+	if (m.count > 0)
+	{
+		m.hits++;
+		return m.blocks[--m.count];
+	}
+	auto& counter = counters[(int)type];
+	publish(counter, m);
+	decay(*this);
+	//refill half magazine from shared bin
+	m.count = get_bin(*this, type).try_dequeue_bulk(m.blocks, kMagazineSizes[(int)type] / 2);
+	if (m.count > 0)
+	{
+		counter.refills.fetch_add(1, std::memory_order_relaxed);
+		return m.blocks[--m.count];
+	}
+	if (arena.enabled.load(std::memory_order_relaxed))
+	{
+		m.count = arena.spill[(int)type].try_dequeue_bulk(m.blocks, kMagazineSizes[(int)type] / 2);
+		if (m.count == 0)
+			m.count = arena.released[(int)type].try_dequeue_bulk(m.blocks, kMagazineSizes[(int)type] / 2);
+		if (m.count == 0)
+			m.count = arena.carve(type, binSizes[(int)type], m.blocks, kMagazineSizes[(int)type] / 2);
+		if (m.count > 0)
+			return m.blocks[--m.count];
+	}
+	counter.sysAllocs.fetch_add(1, std::memory_order_relaxed);
+	return block_malloc(binSizes[(int)type]);
+}
+
+bool context::set_bin_size(alloc_type type, size_t size)
+{
+	if (type == alloc_type::fastbin || size == 0 || (size & (size - 1)) != 0)
+		return false;
+	if (type == alloc_type::smallbin && (size < kSmallBinSize || size >= kFastBinSize))
+		return false;
+	if (type == alloc_type::largebin && (size <= kFastBinSize || size > arena.regionSize))
+		return false;
+	//blocks already handed out keep their size, archetypes of live worlds keep their layout
+	if (worlds.load(std::memory_order_acquire) != 0 ||
+		counters[(int)type].sysAllocs.load(std::memory_order_relaxed) != 0 ||
+		arena.carved[(int)type].load(std::memory_order_relaxed) != 0)
+		return false;
+	binSizes[(int)type] = size;
+	return true;
+}
+
+memory_resource_i* context::default_resource()
+{
+	struct context_resource final : memory_resource_i
+	{
+		void* malloc(alloc_type type) override { return context::get().malloc(type); }
+		void free(alloc_type type, void* data) override { context::get().free(type, data); }
+		void* buffer_malloc(size_t size) override { return ::malloc(size); }
+		void buffer_free(void* data, size_t) override { ::free(data); }
+	};
+	static context_resource instance;
+	return &instance;
+}
+
+bin_stats context::get_stats(alloc_type type)
+{
+	auto& counter = counters[(int)type];
+	publish(counter, tcache.bins[(int)type]);
+	bin_stats stats;
+	stats.allocs = counter.allocs.load(std::memory_order_relaxed);
+	stats.frees = counter.frees.load(std::memory_order_relaxed);
+	stats.magazineHits = counter.magazineHits.load(std::memory_order_relaxed);
+	stats.refills = counter.refills.load(std::memory_order_relaxed);
+	stats.flushes = counter.flushes.load(std::memory_order_relaxed);
+	stats.sysAllocs = counter.sysAllocs.load(std::memory_order_relaxed);
+	stats.sysFrees = counter.sysFrees.load(std::memory_order_relaxed);
+	stats.arenaBlocks = arena.carved[(int)type].load(std::memory_order_relaxed);
+	stats.hugePageBlocks = arena.hugeCarved[(int)type].load(std::memory_order_relaxed);
+	stats.trimmed = counter.trimmed.load(std::memory_order_relaxed);
+	stats.pooledBlocks = get_bin(*this, type).size_approx() + arena.spill[(int)type].size_approx();
+	stats.releasedBlocks = arena.released[(int)type].size_approx();
+	const size_t size = binSizes[(int)type];
+	stats.pooledBytes = stats.pooledBlocks * size;
+	//counters of other threads may lag behind
+	stats.inUseBytes = stats.allocs > stats.frees ? (size_t)(stats.allocs - stats.frees) * size : 0;
+	return stats;
+}
+
+void context::flush_thread_cache()
+{
+	for (size_t i = 0; i < kBinCount; ++i)
+	{
+		auto& m = tcache.bins[i];
+		publish(counters[i], m);
+		if (m.count == 0)
+			continue;
+		counters[i].flushes.fetch_add(1, std::memory_order_relaxed);
+		release(*this, (alloc_type)i, m.blocks, m.count);
+		m.count = 0;
+	}
+}
+
+bool context::enable_arena(size_t regionSize, bool hugePages)
+{
+	std::lock_guard<std::mutex> guard(arena.lock);
+	arena.regionSize = std::max(regionSize, binSizes[(int)alloc_type::largebin]);
+	arena.hugePages = hugePages;
+	if (arena.regionCount.load(std::memory_order_relaxed) == 0 && !arena.map_region())
+		return false;
+	arena.enabled.store(true, std::memory_order_relaxed);
+	return true;
+}
+
+arena_stats context::get_arena_stats()
+{
+	std::lock_guard<std::mutex> guard(arena.lock);
+	arena_stats stats;
+	stats.regions = arena.regionCount.load(std::memory_order_relaxed);
+	for (size_t i = 0; i < stats.regions; ++i)
+	{
+		const auto& r = arena.regions[i];
+		stats.hugePageRegions += r.huge;
+		stats.advisedRegions += r.advised;
+		stats.reservedBytes += r.size;
+		stats.carvedBytes += (i + 1 == stats.regions) ? arena.top : r.size;
+	}
+	return stats;
+}
+
+size_t context::prewarm(alloc_type type, size_t count, prefault_mode mode)
+{
+	auto& bin = get_bin(*this, type);
+	const size_t size = binSizes[(int)type];
+	size_t pooled = 0;
+	while (pooled < count)
+	{
+		void* block = nullptr;
+		if (!arena.enabled.load(std::memory_order_relaxed) || arena.carve(type, size, &block, 1) == 0)
+		{
+			counters[(int)type].sysAllocs.fetch_add(1, std::memory_order_relaxed);
+			block = block_malloc(size);
+		}
+		prefault(block, size, mode);
+		if (!bin.try_enqueue(block))
+		{
+			if (!arena.owns(block))
+			{
+				counters[(int)type].sysFrees.fetch_add(1, std::memory_order_relaxed);
+				block_free(block);
+				break;
+			}
+			arena.spill[(int)type].enqueue(block);
+		}
+		pooled++;
+	}
+	return pooled;
+}
+
+void context::prefault(void* data, size_t size, prefault_mode mode)
+{
+	if (mode == prefault_mode::none || data == nullptr)
+		return;
+	if (mode == prefault_mode::lock)
+	{
+#if defined(_WIN32)
+		if (VirtualLock(data, size))
+			return;
+#elif defined(DOTS_ARENA_MMAP)
+		if (mlock(data, size) == 0)
+			return;
+#endif
+	}
+	//rewrite in place, reserved chunks already hold their header
+	volatile char* page = (volatile char*)data;
+	for (size_t i = 0; i < size; i += kPageSize)
+		page[i] = page[i];
+}
+
+size_t context::trim(alloc_type type, size_t keep)
+{
+	auto& bin = get_bin(*this, type);
+	auto& spill = arena.spill[(int)type];
+	size_t pooled = bin.size_approx() + spill.size_approx();
+	size_t released = 0;
+	constexpr size_t kBatch = 64;
+	void* blocks[kBatch];
+	while (pooled > keep)
 	{
-	case alloc_type::fastbin:
-		if (!fastbin.try_dequeue(result))
-			result = ::malloc(kFastBinSize);
-		break;
-	case alloc_type::smallbin:
-		if (!smallbin.try_dequeue(result))
-			result = ::malloc(kSmallBinSize);
-		break;
-	case alloc_type::largebin:
-		if (!largebin.try_dequeue(result))
-			result = ::malloc(kLargeBinSize);
-		break;
+		size_t want = std::min(pooled - keep, kBatch);
+		size_t n = spill.try_dequeue_bulk(blocks, want);
+		n += bin.try_dequeue_bulk(blocks + n, want - n);
+		if (n == 0)
+			break;
+		for (size_t i = 0; i < n; ++i)
+			released += discard(*this, type, blocks[i]);
+		pooled -= n;
 	}
-	return result;
+	return released;
+}
+
+size_t context::trim_all()
+{
+	flush_thread_cache();
+	size_t released = 0;
+	for (size_t i = 0; i < kBinCount; ++i)
+		released += trim((alloc_type)i);
+	return released;
+}
+
+void context::set_trim_policy(const trim_policy& p)
+{
+	policyEnabled.store(false, std::memory_order_relaxed);
+	policy = p;
+	using namespace std::chrono;
+	lastDecay.store(duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+	policyEnabled.store(true, std::memory_order_release);
+}
+
+void context::disable_trim_policy()
+{
+	policyEnabled.store(false, std::memory_order_release);
+}
+
+size_t context::maintain()
+{
+	return decay(*this);
 }
 
 type_index context::register_type(component_desc desc)
@@ -131,7 +646,7 @@ type_index context::register_type(component_desc desc)
 	}
 	index_t id = (index_t)infos.size();
 	id = type_index{ id, type };
-	type_registry i{ desc.GUID, desc.size, desc.elementSize, desc.alignment, rid, desc.entityRefCount, desc.name, desc.vtable };
+	type_registry i{ desc.GUID, desc.size, desc.elementSize, desc.alignment, rid, desc.entityRefCount, desc.name, desc.vtable, desc.adaptiveCapacity, desc.columnAlignment };
 	infos.push_back(i);
 	uint8_t s = 0;
 	if (desc.manualClean)
@@ -145,7 +660,7 @@ type_index context::register_type(component_desc desc)
 	{
 		index_t id2 = (index_t)infos.size();
 		id2 = type_index{ id2, type };
-		type_registry i2{ desc.GUID, desc.size, desc.elementSize, desc.alignment, rid, desc.entityRefCount, desc.name, desc.vtable };
+		type_registry i2{ desc.GUID, desc.size, desc.elementSize, desc.alignment, rid, desc.entityRefCount, desc.name, desc.vtable, desc.adaptiveCapacity, desc.columnAlignment };
 		tracks.push_back(Copying);
 		infos.push_back(i2);
 	}
@@ -52,8 +52,16 @@
 #include <array>
 #include <map>
 #include <bitset>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstring>
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
 #include "concurrentqueue.h"
 #include "Set.h"
+#include "FlatMap.h"
 
 namespace core
 {
@@ -62,6 +70,8 @@ namespace core
 	{
 		using underlying_type = T;
 		static_assert(A + B == sizeof(T) * 8, "size does not fit into T");
+		static constexpr size_t id_bits = A;
+		static constexpr size_t version_bits = B;
 		union
 		{
 			T value;
@@ -72,13 +82,13 @@ namespace core
 			};
 		};
 		constexpr static T Null = std::numeric_limits<T>::max();
-		constexpr static T TransientMagicNumber = ((1 << B) - 1);
+		constexpr static T TransientMagicNumber = ((T(1) << B) - 1);
 		constexpr operator T() const { return value; }
 		constexpr handle() = default;
 		constexpr handle(nullptr_t) : value(Null) {};
 		constexpr handle(T t) : value(t) { }
 		constexpr handle(T i, T v) : id(i), version(v) { }
-		constexpr bool is_transient() { return version == ((1 << B) - 1); }
+		constexpr bool is_transient() { return version == TransientMagicNumber; }
 		constexpr static T make_transient(T i) { return handle{ i, TransientMagicNumber }.value; }
 		constexpr static T recycle(T version)
 		{
@@ -86,9 +96,16 @@ namespace core
 		}
 	};
 
-	struct entity : handle<24, 8>
+#ifdef ENABLE_64BIT_ENTITY
+	//40 bit id, 24 bit version
+	using entity_handle = handle<40, 24, uint64_t>;
+#else
+	using entity_handle = handle<24, 8>;
+#endif
+
+	struct entity : entity_handle
 	{
-		using ut = handle<24, 8>;
+		using ut = entity_handle;
 		using ut::handle;
 	};
 	constexpr entity NullEntity = entity::Null;
@@ -107,23 +124,96 @@ namespace core
 			using value_type = std::array<std::byte, 16>;
 			return reinterpret_cast<const value_type&>(*this) < reinterpret_cast<const value_type&>(rhs);
 		}
+
+		bool operator==(const GUID& rhs) const
+		{
+			return memcmp(this, &rhs, sizeof(GUID)) == 0;
+		}
+
+		struct hash
+		{
+			size_t operator()(const GUID& guid) const noexcept;
+		};
 	};
 #ifdef __EMSCRIPTEN__
 	constexpr size_t _FNV_offset_basis = 2166136261U;
-	constexpr size_t _FNV_prime = 16777619U;
 #else
 	constexpr size_t _FNV_offset_basis = sizeof(size_t) == sizeof(uint32_t) ? 2166136261U : 14695981039346656037ULL;
-	constexpr size_t _FNV_prime = sizeof(uint32_t) ? 16777619U : 1099511628211ULL;
 #endif
 
+	constexpr uint64_t _hash_secret[4] = { 0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull };
+
+	inline uint64_t hash_mum(uint64_t a, uint64_t b) noexcept
+	{ // 64x64->128 multiply, fold high and low halves
+#if defined(_MSC_VER) && defined(_M_X64)
+		uint64_t hi;
+		uint64_t lo = _umul128(a, b, &hi);
+		return lo ^ hi;
+#elif defined(__SIZEOF_INT128__)
+		__uint128_t r = (__uint128_t)a * b;
+		return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+		uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+		uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32);
+		uint64_t c = t < rl;
+		uint64_t lo = t + (rm1 << 32);
+		c += lo < t;
+		uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+		return lo ^ hi;
+#endif
+	}
+
+	inline uint64_t hash_read64(const unsigned char* p) noexcept { uint64_t v; memcpy(&v, p, 8); return v; }
+	inline uint64_t hash_read32(const unsigned char* p) noexcept { uint32_t v; memcpy(&v, p, 4); return v; }
+
 	inline size_t hash_append(size_t val, const unsigned char* const data, const size_t length) noexcept
-	{ // accumulate range [data, data + length) into partial FNV-1a uuid val
-		for (size_t i = 0; i < length; ++i) {
-			val ^= static_cast<size_t>(data[i]);
-			val *= _FNV_prime;
+	{ // accumulate range [data, data + length) into partial hash val, wyhash style 16 bytes per multiply
+		const uint64_t* s = _hash_secret;
+		const unsigned char* p = data;
+		uint64_t seed = (uint64_t)val ^ s[0];
+		uint64_t a, b;
+		if (length <= 16)
+		{
+			if (length >= 4)
+			{
+				size_t q = (length >> 3) << 2;
+				a = (hash_read32(p) << 32) | hash_read32(p + q);
+				b = (hash_read32(p + length - 4) << 32) | hash_read32(p + length - 4 - q);
+			}
+			else if (length > 0)
+			{
+				a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+				b = 0;
+			}
+			else
+				a = b = 0;
 		}
-
-		return val;
+		else
+		{
+			size_t i = length;
+			if (i > 48)
+			{
+				uint64_t see1 = seed, see2 = seed;
+				do
+				{
+					seed = hash_mum(hash_read64(p) ^ s[1], hash_read64(p + 8) ^ seed);
+					see1 = hash_mum(hash_read64(p + 16) ^ s[2], hash_read64(p + 24) ^ see1);
+					see2 = hash_mum(hash_read64(p + 32) ^ s[3], hash_read64(p + 40) ^ see2);
+					p += 48;
+					i -= 48;
+				} while (i > 48);
+				seed ^= see1 ^ see2;
+			}
+			while (i > 16)
+			{
+				seed = hash_mum(hash_read64(p) ^ s[1], hash_read64(p + 8) ^ seed);
+				i -= 16;
+				p += 16;
+			}
+			a = hash_read64(p + i - 16);
+			b = hash_read64(p + i - 8);
+		}
+		return (size_t)hash_mum(s[1] ^ length, hash_mum(a ^ s[1], b ^ seed));
 	}
 
 	template <class T>
@@ -134,6 +224,11 @@ namespace core
 			basis, reinterpret_cast<const unsigned char*>(data), length * sizeof(T));
 	}
 
+	inline size_t GUID::hash::operator()(const GUID& guid) const noexcept
+	{
+		return hash_array(&guid, 1);
+	}
+
 	namespace guid_parse
 	{
 		namespace details
@@ -259,15 +354,32 @@ namespace core
 
 		constexpr uint16_t InvalidIndex = (uint16_t)-1;
 
+		// default block sizes, smallbin and largebin can be changed by context::set_bin_size
 		static constexpr size_t kFastBinSize = 64 * 1024;
 		static constexpr size_t kSmallBinThreshold = 8;
 		static constexpr size_t kSmallBinSize = 1024;
 		static constexpr size_t kLargeBinSize = 1024 * 1024;
+		// archetypes fitting fewer entities into a smallbin start with fastbin chunks
+		static constexpr size_t kMinChunkEntities = 16;
+		// chunk blocks start on a cache line, upper bound of column alignment
+		static constexpr size_t kChunkAlignment = 64;
 
 		static constexpr size_t kFastBinCapacity = 800;
 		static constexpr size_t kSmallBinCapacity = 200;
 		static constexpr size_t kLargeBinCapacity = 80;
 
+		// per-thread magazine in front of the shared bins, refilled/flushed in batches of half capacity
+		static constexpr size_t kFastBinMagazine = 16;
+		static constexpr size_t kSmallBinMagazine = 32;
+		static constexpr size_t kLargeBinMagazine = 4;
+		static constexpr size_t kBinCount = 3;
+
+		// optional arena mode, bins are carved out of large (huge page backed if possible) regions
+		static constexpr size_t kArenaRegionSize = 64 * 1024 * 1024;
+		static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+		static constexpr size_t kMaxArenaRegions = 256;
+		static constexpr size_t kScratchBlockSize = 16 * 1024;
+
 		struct serializer_i
 		{
 			virtual void stream(const void* data, uint32_t bytes) = 0;
@@ -313,50 +425,46 @@ namespace core
 			uint16_t entityRefCount = 0;
 			component_vtable vtable;
 			const char* name = nullptr;
+			/* buffer inline capacity may be changed per world by world::adapt_buffers,
+			   index it with world::get_size instead of a fixed stride */
+			bool adaptiveCapacity = false;
+			/* align the column start to this(at most kChunkAlignment), chunk capacities are padded so
+			   the column length is a multiple of it. 0 to only respect alignment */
+			uint16_t columnAlignment = 0;
 		};
 
-		struct stack_allocator
+		/* per-thread growable bump allocator, memory is freed in bulk by rewinding to a marker */
+		struct scratch_arena
 		{
-			char* stackbuffer = nullptr;
-			void* stacktop = nullptr;
-			size_t stackSize = 0;
-			void* alloc(size_t size, size_t align = alignof(int))
-			{
-				auto offset = uint32_t((char*)stacktop - stackbuffer);
-				stacktop = (uint32_t*)stacktop + 1;
-				if (std::align(align, size, stacktop, stackSize))
-				{
-					*((uint32_t*)stacktop - 1) = offset;
-					auto result = stacktop;
-					stacktop = (char*)stacktop + size;
-					stackSize -= size + sizeof(uint32_t);
-					return result;
-				}
-				return nullptr;
-			}
-			void free(void* ptr, size_t size)
+			struct block
 			{
-				auto offset = uint32_t((char*)stacktop - stackbuffer);
-				auto oldOffset = *((uint32_t*)ptr - 1);
-				stackSize += offset - oldOffset;
-				stacktop = stackbuffer + oldOffset;
-			}
-			void init(size_t size)
-			{
-				stackSize = size;
-				stacktop = stackbuffer = (char*)::malloc(size);
-			}
-			void reset()
+				block* prev;
+				size_t size;
+			};
+			struct marker
 			{
-				if (stackbuffer != nullptr)
-					::free(stackbuffer);
-				stacktop = stackbuffer = nullptr;
-				stackSize = 0;
-			}
-			~stack_allocator()
+				block* b;
+				char* top;
+			};
+			block* current = nullptr;
+			char* top = nullptr;
+			char* end = nullptr;
+			block* spare = nullptr; //largest retired block, reused on next growth
+
+			void* alloc(size_t size, size_t align = alignof(std::max_align_t))
 			{
-				reset();
+				char* p = (char*)(((uintptr_t)top + align - 1) & ~(uintptr_t)(align - 1));
+				if (top == nullptr || p + size > end)
+					return grow(size, align);
+				top = p + size;
+				return p;
 			}
+			marker mark() const { return { current, top }; }
+			ECS_RT_API void rewind(marker m);
+			void reset() { rewind({ nullptr, nullptr }); }
+			ECS_RT_API ~scratch_arena();
+		private:
+			ECS_RT_API void* grow(size_t size, size_t align);
 		};
 
 		enum class alloc_type : uint8_t
@@ -364,6 +472,89 @@ namespace core
 			smallbin, fastbin, largebin
 		};
 
+		/* backing memory of a world: chunk bins, chunk_vector segments and buffer overflow storage.
+		   blocks of a bin are context::get_bin_size(type) bytes and should be kChunkAlignment aligned */
+		struct memory_resource_i
+		{
+			virtual void* malloc(alloc_type type) = 0;
+			virtual void free(alloc_type type, void* data) = 0;
+			virtual void* buffer_malloc(size_t size) = 0;
+			virtual void buffer_free(void* data, size_t size) = 0;
+		};
+
+		enum class prefault_mode : uint8_t
+		{
+			none, //leave pages to be faulted on first use
+			touch, //write every page once
+			lock //touch and pin pages in memory, degrade to touch if not permitted
+		};
+
+		struct bin_stats
+		{
+			uint64_t allocs = 0;
+			uint64_t frees = 0;
+			uint64_t magazineHits = 0; //allocs served by the thread magazine
+			uint64_t refills = 0; //magazine refilled from the shared bin
+			uint64_t flushes = 0; //magazine flushed to the shared bin
+			uint64_t sysAllocs = 0; //fallback to ::malloc
+			uint64_t sysFrees = 0; //fallback to ::free
+			uint64_t arenaBlocks = 0; //blocks carved from arena
+			uint64_t hugePageBlocks = 0; //blocks carved from explicit huge page regions
+			uint64_t trimmed = 0; //blocks handed back to the system by trim or policy
+			//snapshot, blocks cached in thread magazines count as neither pooled nor in use
+			size_t pooledBlocks = 0; //blocks idle in shared bin and arena spill
+			size_t releasedBlocks = 0; //arena blocks whose pages were given back, reused before carving
+			size_t pooledBytes = 0;
+			size_t inUseBytes = 0;
+		};
+
+		struct trim_policy
+		{
+			//pooled blocks above high water are released on flush instead of pooled
+			size_t highWater[kBinCount] = { kSmallBinCapacity, kFastBinCapacity, kLargeBinCapacity };
+			//every decay interval, release decayRate of the pooled blocks above low water
+			size_t lowWater[kBinCount] = { 0, 0, 0 };
+			std::chrono::milliseconds decayInterval{ 0 }; //0 disables decay
+			float decayRate = 0.5f;
+		};
+
+		struct arena_stats
+		{
+			size_t regions = 0;
+			size_t hugePageRegions = 0; //MAP_HUGETLB/MEM_LARGE_PAGES
+			size_t advisedRegions = 0; //transparent huge page hint only
+			size_t reservedBytes = 0;
+			size_t carvedBytes = 0;
+		};
+
+		struct chunk_arena
+		{
+			struct region
+			{
+				char* base;
+				size_t size;
+				bool huge;
+				bool advised;
+			};
+			region regions[kMaxArenaRegions];
+			std::atomic<size_t> regionCount{ 0 };
+			std::atomic<bool> enabled{ false };
+			size_t regionSize = kArenaRegionSize;
+			bool hugePages = true;
+			size_t top = 0;
+			std::mutex lock;
+			//arena blocks that do not fit into the bounded bins, arena memory is never handed to ::free
+			moodycamel::ConcurrentQueue<void*> spill[kBinCount];
+			//trimmed arena blocks, pages are decommitted but address range stays reserved
+			moodycamel::ConcurrentQueue<void*> released[kBinCount];
+			std::atomic<uint64_t> carved[kBinCount]{};
+			std::atomic<uint64_t> hugeCarved[kBinCount]{};
+
+			bool owns(const void* ptr) const noexcept;
+			size_t carve(alloc_type type, size_t size, void** blocks, size_t count);
+			bool map_region();
+		};
+
 		struct type_registry
 		{
 			core::GUID GUID = core::GUID();
@@ -374,6 +565,8 @@ namespace core
 			uint16_t entityRefCount;
 			const char* name;
 			component_vtable vtable;
+			bool adaptiveCapacity;
+			uint16_t columnAlignment;
 		};
 
 		struct context
@@ -381,11 +574,31 @@ namespace core
 			std::vector<type_registry> infos;
 			std::vector<track_state> tracks;
 			std::vector<intptr_t> entityRefs;
-			std::map<core::GUID, size_t> hash2type;
+			flat_map<core::GUID, size_t, core::GUID::hash> hash2type;
 
 			moodycamel::ConcurrentQueue<void*> fastbin{ kFastBinCapacity };
 			moodycamel::ConcurrentQueue<void*> smallbin{ kSmallBinCapacity };
 			moodycamel::ConcurrentQueue<void*> largebin{ kLargeBinCapacity };
+			size_t binSizes[kBinCount] = { kSmallBinSize, kFastBinSize, kLargeBinSize };
+			//live worlds, their archetypes are laid out for the current bin sizes
+			std::atomic<uint32_t> worlds{ 0 };
+			//column alignment of every component in archetypes created afterwards, 0 for per component only
+			uint16_t columnAlignment = 0;
+			struct bin_counters
+			{
+				std::atomic<uint64_t> allocs{ 0 };
+				std::atomic<uint64_t> frees{ 0 };
+				std::atomic<uint64_t> magazineHits{ 0 };
+				std::atomic<uint64_t> refills{ 0 };
+				std::atomic<uint64_t> flushes{ 0 };
+				std::atomic<uint64_t> sysAllocs{ 0 };
+				std::atomic<uint64_t> sysFrees{ 0 };
+				std::atomic<uint64_t> trimmed{ 0 };
+			} counters[kBinCount];
+			chunk_arena arena;
+			trim_policy policy;
+			std::atomic<bool> policyEnabled{ false };
+			std::atomic<int64_t> lastDecay{ 0 };
 			type_index disable_id;
 			type_index cleanup_id;
 			type_index group_id;
@@ -395,24 +608,49 @@ namespace core
 			type_index guid_id;
 #endif
 
-			stack_allocator stack;
-
 			ECS_RT_API static context& get();
-
-			void* stack_alloc(size_t size, size_t align = alignof(int))
-			{
-				return stack.alloc(size, align);
-			}
-
-			void stack_free(void* ptr, size_t size)
-			{
-				return stack.free(ptr, size);
-			}
+			/* scratch memory of calling thread */
+			ECS_RT_API static scratch_arena& scratch();
 
 			ECS_RT_API void free(alloc_type type, void* data);
 
 			ECS_RT_API void* malloc(alloc_type type);
 
+			size_t get_bin_size(alloc_type type) const noexcept { return binSizes[(int)type]; }
+			/* change the block size of a bin before any world exists or any block of it is allocated, e.g. 16KB smallbins to fit L2.
+			   size must be a power of two, smallbin in [kSmallBinSize, kFastBinSize) and largebin above kFastBinSize.
+			   fastbin is fixed, entity tables and buffer slabs are built on it. return false if rejected */
+			ECS_RT_API bool set_bin_size(alloc_type type, size_t size);
+
+			/* resource backed by the shared bins and ::malloc, used by worlds without their own */
+			ECS_RT_API static memory_resource_i* default_resource();
+
+			/* note: counters of other threads are published on their magazine refill/flush */
+			ECS_RT_API bin_stats get_stats(alloc_type type);
+			/* return blocks cached by calling thread to the shared bins */
+			ECS_RT_API void flush_thread_cache();
+
+			/* carve bins out of big mmap regions, try huge pages first and fall back to regular pages.
+			   return false if no region could be reserved, in which case ::malloc keeps being used */
+			ECS_RT_API bool enable_arena(size_t regionSize = kArenaRegionSize, bool hugePages = true);
+			ECS_RT_API arena_stats get_arena_stats();
+
+			/* push up to count blocks into the shared bin ahead of time, return the number pooled */
+			ECS_RT_API size_t prewarm(alloc_type type, size_t count, prefault_mode mode = prefault_mode::none);
+			ECS_RT_API static void prefault(void* data, size_t size, prefault_mode mode);
+
+			/* release pooled blocks of a bin until at most keep remain, return the number released.
+			   arena pages are decommitted with madvise(MADV_DONTNEED), other blocks are ::free'd */
+			ECS_RT_API size_t trim(alloc_type type, size_t keep = 0);
+			ECS_RT_API size_t trim_all();
+			/* high water is applied when magazines flush, decay runs on the slow path of malloc/free
+			   and on maintain */
+			ECS_RT_API void set_trim_policy(const trim_policy& policy);
+			ECS_RT_API void disable_trim_policy();
+			/* run a decay step if the interval passed, return the number of blocks released.
+			   call it periodically(e.g. once per frame), pooled blocks of an idle process only decay here */
+			ECS_RT_API size_t maintain();
+
 			ECS_RT_API type_index register_type(component_desc desc);
 		private:
 			context();
@@ -0,0 +1,166 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <tuple>
+
+namespace core
+{
+	/* open addressing hash map, entries are stored densely in insertion order and
+	   a linear probing slot table indexes them. erase moves the last entry into the hole.
+	   note: insertion and erase invalidate iterators and references */
+	template<class K, class V, class Hash = std::hash<K>, class Eq = std::equal_to<K>>
+	class flat_map
+	{
+	public:
+		using value_type = std::pair<K, V>;
+		using iterator = value_type*;
+		using const_iterator = const value_type*;
+
+	private:
+		struct slot
+		{
+			uint32_t index; //entry index + 1, 0 for empty
+			uint32_t hash;
+		};
+		std::vector<value_type> entries;
+		std::vector<slot> slots;
+		uint32_t slotMask = 0;
+
+		static uint32_t hash_of(const K& key) noexcept { return (uint32_t)Hash{}(key); }
+
+		//slot of key, or the empty slot ending its probe sequence
+		uint32_t probe(const K& key, uint32_t h) const
+		{
+			uint32_t i = h & slotMask;
+			while (true)
+			{
+				const slot& s = slots[i];
+				if (s.index == 0 || (s.hash == h && Eq{}(entries[s.index - 1].first, key)))
+					return i;
+				i = (i + 1) & slotMask;
+			}
+		}
+
+		void rehash(size_t count)
+		{
+			size_t size = 8;
+			while (size < count * 2)
+				size *= 2;
+			std::vector<slot> old(size, slot{ 0, 0 });
+			old.swap(slots);
+			slotMask = (uint32_t)size - 1;
+			for (const slot& s : old)
+			{
+				if (s.index == 0)
+					continue;
+				uint32_t i = s.hash & slotMask;
+				while (slots[i].index != 0)
+					i = (i + 1) & slotMask;
+				slots[i] = s;
+			}
+		}
+
+		void erase_slot(uint32_t i)
+		{
+			uint32_t index = slots[i].index - 1;
+			//backward shift, keeps probe sequences intact without tombstones
+			uint32_t j = i;
+			while (true)
+			{
+				j = (j + 1) & slotMask;
+				if (slots[j].index == 0)
+					break;
+				uint32_t ideal = slots[j].hash & slotMask;
+				if (((j - ideal) & slotMask) >= ((j - i) & slotMask))
+				{
+					slots[i] = slots[j];
+					i = j;
+				}
+			}
+			slots[i] = slot{ 0, 0 };
+			uint32_t last = (uint32_t)entries.size() - 1;
+			if (index != last)
+			{
+				uint32_t h = hash_of(entries[last].first);
+				uint32_t k = h & slotMask;
+				while (slots[k].index != last + 1)
+					k = (k + 1) & slotMask;
+				slots[k].index = index + 1;
+				entries[index] = std::move(entries[last]);
+			}
+			entries.pop_back();
+		}
+
+	public:
+		iterator begin() noexcept { return entries.data(); }
+		iterator end() noexcept { return entries.data() + entries.size(); }
+		const_iterator begin() const noexcept { return entries.data(); }
+		const_iterator end() const noexcept { return entries.data() + entries.size(); }
+		size_t size() const noexcept { return entries.size(); }
+		bool empty() const noexcept { return entries.empty(); }
+
+		void reserve(size_t count)
+		{
+			entries.reserve(count);
+			if (slots.size() < count * 2)
+				rehash(count);
+		}
+
+		iterator find(const K& key)
+		{
+			if (entries.empty())
+				return end();
+			const slot& s = slots[probe(key, hash_of(key))];
+			return s.index == 0 ? end() : entries.data() + s.index - 1;
+		}
+
+		const_iterator find(const K& key) const
+		{
+			return const_cast<flat_map*>(this)->find(key);
+		}
+
+		template<class... Ts>
+		std::pair<iterator, bool> emplace(const K& key, Ts&&... args)
+		{
+			if ((entries.size() + 1) * 2 > slots.size())
+				rehash(entries.size() + 1);
+			uint32_t h = hash_of(key);
+			slot& s = slots[probe(key, h)];
+			if (s.index != 0)
+				return { entries.data() + s.index - 1, false };
+			entries.emplace_back(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Ts>(args)...));
+			s = slot{ (uint32_t)entries.size(), h };
+			return { &entries.back(), true };
+		}
+
+		std::pair<iterator, bool> insert(const value_type& value)
+		{
+			return emplace(value.first, value.second);
+		}
+
+		V& operator[](const K& key)
+		{
+			return emplace(key).first->second;
+		}
+
+		size_t erase(const K& key)
+		{
+			if (entries.empty())
+				return 0;
+			uint32_t i = probe(key, hash_of(key));
+			if (slots[i].index == 0)
+				return 0;
+			erase_slot(i);
+			return 1;
+		}
+
+		void clear() noexcept
+		{
+			entries.clear();
+			slots.clear();
+			slotMask = 0;
+		}
+	};
+}
@@ -1,4 +1,5 @@
 #include "pch.h"
+#include <chrono>
 #define forloop(i, z, n) for(auto i = decltype(n)(z); i<n; ++i)
 
 
@@ -21,6 +22,11 @@ struct test_element
 	int v;
 };
 
+struct test_adaptive
+{
+	int v;
+};
+
 struct test_not_exist
 {
 	
@@ -38,6 +44,10 @@ struct test_ref
 
 struct test_tag {};
 
+//plain components to build wide archetypes
+constexpr int kLookupBenchTypes = 64;
+core::database::type_index benchTypes[kLookupBenchTypes];
+
 TEST(MetaTest, Equal) 
 {
   EXPECT_EQ(1, 1);
@@ -101,6 +111,320 @@ TEST(DSTest, ChunkVector)
 
 }
 
+TEST(DSTest, BinMagazine)
+{
+	using namespace core::database;
+	auto& ctx = context::get();
+	auto before = ctx.get_stats(alloc_type::fastbin);
+	void* a = ctx.malloc(alloc_type::fastbin);
+	ctx.free(alloc_type::fastbin, a);
+	void* b = ctx.malloc(alloc_type::fastbin);
+	EXPECT_EQ(a, b); //served by thread magazine
+	ctx.free(alloc_type::fastbin, b);
+	auto after = ctx.get_stats(alloc_type::fastbin);
+	EXPECT_EQ(after.allocs - before.allocs, 2);
+	EXPECT_EQ(after.frees - before.frees, 2);
+	EXPECT_GE(after.magazineHits - before.magazineHits, 1);
+	ctx.flush_thread_cache();
+}
+
+TEST(DSTest, BinArena)
+{
+	using namespace core::database;
+	auto& ctx = context::get();
+	if (!ctx.enable_arena(kHugePageSize * 4))
+		return; //no mmap on this platform, bins keep using ::malloc
+	auto stats = ctx.get_arena_stats();
+	EXPECT_GE(stats.regions, 1);
+	EXPECT_EQ(stats.reservedBytes % kHugePageSize, 0);
+
+	//drain shared bin and magazine so the arena has to be carved
+	constexpr size_t count = kLargeBinCapacity + kLargeBinMagazine + 1;
+	auto before = ctx.get_stats(alloc_type::largebin);
+	void* blocks[count];
+	for (auto& b : blocks)
+	{
+		b = ctx.malloc(alloc_type::largebin);
+		memset(b, 0, CACHE_LINE_SIZE);
+	}
+	auto after = ctx.get_stats(alloc_type::largebin);
+	EXPECT_GT(after.arenaBlocks, before.arenaBlocks);
+	EXPECT_LE(after.hugePageBlocks, after.arenaBlocks);
+	for (auto& b : blocks)
+		ctx.free(alloc_type::largebin, b);
+	ctx.flush_thread_cache();
+}
+
+TEST(DSTest, BinTrim)
+{
+	using namespace core::database;
+	auto& ctx = context::get();
+	constexpr size_t count = kFastBinMagazine * 4;
+	void* blocks[count];
+	for (auto& b : blocks)
+		b = ctx.malloc(alloc_type::fastbin);
+	EXPECT_GE(ctx.get_stats(alloc_type::fastbin).inUseBytes, count * kFastBinSize);
+	for (auto& b : blocks)
+		ctx.free(alloc_type::fastbin, b);
+	ctx.flush_thread_cache();
+	EXPECT_GE(ctx.get_stats(alloc_type::fastbin).pooledBlocks, count);
+	EXPECT_GE(ctx.trim(alloc_type::fastbin), count);
+	auto stats = ctx.get_stats(alloc_type::fastbin);
+	EXPECT_EQ(stats.pooledBlocks, 0);
+	EXPECT_GE(stats.trimmed, count);
+
+	//high water caps the shared bin on flush
+	trim_policy policy;
+	policy.highWater[(int)alloc_type::fastbin] = 2;
+	ctx.set_trim_policy(policy);
+	for (auto& b : blocks)
+		b = ctx.malloc(alloc_type::fastbin);
+	for (auto& b : blocks)
+		ctx.free(alloc_type::fastbin, b);
+	ctx.flush_thread_cache();
+	EXPECT_LE(ctx.get_stats(alloc_type::fastbin).pooledBlocks, 2);
+
+	//decay releases pooled blocks without further allocations
+	policy = trim_policy{};
+	policy.highWater[(int)alloc_type::fastbin] = count * 2;
+	ctx.set_trim_policy(policy);
+	for (auto& b : blocks)
+		b = ctx.malloc(alloc_type::fastbin);
+	for (auto& b : blocks)
+		ctx.free(alloc_type::fastbin, b);
+	ctx.flush_thread_cache();
+	EXPECT_GE(ctx.get_stats(alloc_type::fastbin).pooledBlocks, count);
+	//decay starts only now, the frees above can't run it early
+	policy.decayInterval = std::chrono::milliseconds(1);
+	policy.decayRate = 1.f;
+	ctx.set_trim_policy(policy);
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	EXPECT_GE(ctx.maintain(), count);
+	EXPECT_EQ(ctx.get_stats(alloc_type::fastbin).pooledBlocks, 0);
+	ctx.disable_trim_policy();
+}
+
+TEST(DSTest, TypeTable)
+{
+	using namespace core::database;
+	type_table table;
+	type_index a[] = { tid<test>, tid<test_track> };
+	type_index b[] = { tid<test_track>, tid<test> };
+	auto ta = table.intern(entity_type{ a });
+	auto tb = table.intern(entity_type{ b });
+	EXPECT_EQ(ta, tb);
+	EXPECT_EQ(ta->hash, entity_type::hash{}(entity_type{ a }));
+
+	type_index ext[] = { tid<test_align> };
+	type_index shr[] = { tid<test> };
+	auto d = table.intern(type_diff{ entity_type{ ext }, entity_type{ shr } });
+	auto result = table.apply(ta, d);
+	type_index expected[] = { tid<test_track>, tid<test_align> };
+	EXPECT_EQ(result, table.intern(entity_type{ expected }));
+	EXPECT_EQ(table.apply(ta, d), result); //memoized
+
+	auto merged = table.merge(d, table.intern(type_diff{ entity_type{ shr } }));
+	type_index mergedExt[] = { tid<test>, tid<test_align> };
+	EXPECT_EQ(merged->extend, table.intern(entity_type{ mergedExt }));
+	EXPECT_EQ(merged->shrink, d->shrink);
+	EXPECT_EQ(table.merge(d, table.intern(type_diff{ entity_type{ shr } })), merged);
+}
+
+TEST(DSTest, TypeHash)
+{
+	using namespace core::database;
+	//every length hashes every byte
+	type_index a[kLookupBenchTypes], b[kLookupBenchTypes];
+	std::copy(benchTypes, benchTypes + kLookupBenchTypes, a);
+	forloop(n, 1, (int)kLookupBenchTypes)
+	{
+		std::copy(a, a + n, b);
+		auto h = core::hash_array(a, n);
+		EXPECT_NE(h, core::hash_array(a, n - 1));
+		forloop(i, 0, n)
+		{
+			b[i] = type_index(uint32_t(a[i]) ^ 1u);
+			EXPECT_NE(h, core::hash_array(b, n));
+			b[i] = a[i];
+		}
+	}
+}
+
+//timing only, run with --gtest_also_run_disabled_tests
+TEST(DSTest, DISABLED_TypeHashBench)
+{
+	using namespace core::database;
+	//byte-wise fnv-1a, what hash_array used before
+	auto fnv = [](const type_index* data, size_t length)
+	{
+		constexpr size_t prime = sizeof(size_t) == sizeof(uint32_t) ? 16777619U : 1099511628211ULL;
+		auto bytes = (const unsigned char*)data;
+		size_t val = core::_FNV_offset_basis;
+		forloop(i, (size_t)0, length * sizeof(type_index))
+		{
+			val ^= static_cast<size_t>(bytes[i]);
+			val *= prime;
+		}
+		return val;
+	};
+	type_index a[kLookupBenchTypes];
+	std::copy(benchTypes, benchTypes + kLookupBenchTypes, a);
+	constexpr int counts[] = { 8, 32, 64 };
+	int rounds = 200000;
+	for (int n : counts)
+	{
+		size_t sumWord = 0, sumFnv = 0;
+		auto t0 = std::chrono::high_resolution_clock::now();
+		forloop(r, 0, rounds)
+			sumWord += core::hash_array(a, n - (r & 1));
+		auto t1 = std::chrono::high_resolution_clock::now();
+		forloop(r, 0, rounds)
+			sumFnv += fnv(a, n - (r & 1));
+		auto t2 = std::chrono::high_resolution_clock::now();
+		EXPECT_NE(sumWord, sumFnv);
+		using ns = std::chrono::duration<double, std::nano>;
+		printf("[ hash     ] %2d types: word %.2fns, fnv-1a %.2fns\n", n,
+			ns(t1 - t0).count() / rounds, ns(t2 - t1).count() / rounds);
+	}
+}
+
+TEST(DSTest, TypeSignature)
+{
+	using namespace core::database;
+	type_signature a, b, c;
+	a.add(type_index(3, ct_pod));
+	a.add(type_index(200, ct_tag));
+	b.add(type_index(200, ct_pod));
+	c.add(type_index(64, ct_pod));
+	EXPECT_TRUE(a.all(b));
+	EXPECT_TRUE(a.any(b));
+	EXPECT_FALSE(a.any(c));
+	EXPECT_FALSE(a.all(b | c));
+	EXPECT_TRUE((a | c).all(b | c));
+	EXPECT_TRUE(a.all(type_signature{}));
+	EXPECT_FALSE(a.overflow);
+	a.add(type_index(type_signature::kBits, ct_pod));
+	EXPECT_TRUE(a.overflow);
+	EXPECT_TRUE((a | b).overflow);
+}
+
+TEST(DSTest, FlatMap)
+{
+	using namespace core::database;
+	//random churn against std::unordered_map
+	{
+		core::flat_map<uint32_t, uint32_t> map;
+		std::unordered_map<uint32_t, uint32_t> ref;
+		uint32_t seed = 1;
+		forloop(i, 0, 100000)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			uint32_t key = (seed >> 8) % 5000;
+			if (seed & 1)
+			{
+				map[key] = i;
+				ref[key] = i;
+			}
+			else
+				EXPECT_EQ(map.erase(key), ref.erase(key));
+		}
+		ASSERT_EQ(map.size(), ref.size());
+		for (auto& pair : ref)
+		{
+			auto iter = map.find(pair.first);
+			ASSERT_NE(iter, map.end());
+			EXPECT_EQ(iter->second, pair.second);
+		}
+	}
+
+	//per-meta-entity archetype keys
+	constexpr uint32_t count = 16384;
+	type_index t[] = { tid<test>, tid<test_track> };
+	std::vector<core::entity> metas(count);
+	std::vector<hashed_key<entity_type>> keys;
+	keys.reserve(count);
+	forloop(i, 0u, count)
+	{
+		metas[i] = core::entity::make_transient(i);
+		keys.push_back({ entity_type{ typeset{ t }, metaset{ &metas[i], 1 } } });
+	}
+	using key_t = hashed_key<entity_type>;
+	core::flat_map<key_t, uint32_t, key_t::hasher> flat;
+	std::unordered_map<key_t, uint32_t, key_t::hasher> node;
+	forloop(i, 0u, count)
+	{
+		flat.insert({ keys[i], i });
+		node.insert({ keys[i], i });
+	}
+	forloop(i, 0u, count)
+		ASSERT_EQ(flat.find(keys[i])->second, node.find(keys[i])->second);
+	size_t iterFlat = 0, iterNode = 0;
+	for (auto& pair : flat)
+		iterFlat += pair.second;
+	for (auto& pair : node)
+		iterNode += pair.second;
+	EXPECT_EQ(iterFlat, iterNode);
+
+	forloop(i, 0u, count / 2)
+		flat.erase(keys[i * 2]);
+	EXPECT_EQ(flat.size(), count / 2);
+	forloop(i, 0u, count)
+		EXPECT_EQ(flat.find(keys[i]) == flat.end(), i % 2 == 0);
+}
+
+//timing only, run with --gtest_also_run_disabled_tests
+TEST(DSTest, DISABLED_FlatMapBench)
+{
+	using namespace core::database;
+	//per-meta-entity archetype keys
+	constexpr uint32_t count = 16384;
+	type_index t[] = { tid<test>, tid<test_track> };
+	std::vector<core::entity> metas(count);
+	std::vector<hashed_key<entity_type>> keys;
+	keys.reserve(count);
+	forloop(i, 0u, count)
+	{
+		metas[i] = core::entity::make_transient(i);
+		keys.push_back({ entity_type{ typeset{ t }, metaset{ &metas[i], 1 } } });
+	}
+	using key_t = hashed_key<entity_type>;
+	core::flat_map<key_t, uint32_t, key_t::hasher> flat;
+	std::unordered_map<key_t, uint32_t, key_t::hasher> node;
+	forloop(i, 0u, count)
+	{
+		flat.insert({ keys[i], i });
+		node.insert({ keys[i], i });
+	}
+	int rounds = 20;
+	size_t sumFlat = 0, sumNode = 0;
+	auto t0 = std::chrono::high_resolution_clock::now();
+	forloop(r, 0, rounds)
+		for (uint32_t i = 0; i < count; i += 1 + (uint32_t)r % 3)
+			sumFlat += flat.find(keys[i])->second;
+	auto t1 = std::chrono::high_resolution_clock::now();
+	forloop(r, 0, rounds)
+		for (uint32_t i = 0; i < count; i += 1 + (uint32_t)r % 3)
+			sumNode += node.find(keys[i])->second;
+	auto t2 = std::chrono::high_resolution_clock::now();
+	EXPECT_EQ(sumFlat, sumNode);
+	size_t iterFlat = 0, iterNode = 0;
+	auto t3 = std::chrono::high_resolution_clock::now();
+	for (auto& pair : flat)
+		iterFlat += pair.second;
+	auto t4 = std::chrono::high_resolution_clock::now();
+	for (auto& pair : node)
+		iterNode += pair.second;
+	auto t5 = std::chrono::high_resolution_clock::now();
+	EXPECT_EQ(iterFlat, iterNode);
+	using ns = std::chrono::duration<double, std::nano>;
+	size_t lookups = 0;
+	forloop(r, 0, rounds)
+		lookups += (count + r % 3) / (1 + r % 3);
+	printf("[ map      ] %u archetype keys: find flat %.2fns, node %.2fns; iterate flat %.2fns, node %.2fns\n", count,
+		ns(t1 - t0).count() / lookups, ns(t2 - t1).count() / lookups,
+		ns(t4 - t3).count() / count, ns(t5 - t4).count() / count);
+}
+
 class DatabaseTest : public ::testing::Test
 {
 protected:
@@ -114,6 +438,43 @@ protected:
 		auto c = vector[0];
 		return ctx.get_entities(c.c)[c.start];
 	}
+	//small batches spread over several chunks
+	std::vector<core::entity> allocate_batches(const core::database::entity_type& type, int batches, uint32_t count)
+	{
+		std::vector<core::entity> es;
+		forloop(k, 0, batches)
+			for (auto s : ctx.allocate(type, count))
+			{
+				auto ents = ctx.get_entities(s.c);
+				es.insert(es.end(), ents + s.start, ents + s.start + s.count);
+			}
+		return es;
+	}
+	static uint32_t region(const core::database::archetype* g, const core::database::chunk* c)
+	{
+		uint32_t capacity = g->chunkCapacity[(int)c->ct];
+		return c->count == capacity ? 0u : core::database::kOccupancyBuckets - c->count * core::database::kOccupancyBuckets / capacity;
+	}
+	//chunk table invariants, slots and buckets in order and g->size matching the chunks
+	void check_chunks(const core::database::archetype* g)
+	{
+		using namespace core::database;
+		uint32_t size = 0, last = 0;
+		forloop(i, 0u, g->chunkCount)
+		{
+			chunk* c = g->chunks[i];
+			EXPECT_EQ(c->index, i);
+			EXPECT_EQ(c->type, g);
+			EXPECT_GE(region(g, c), last);
+			last = region(g, c);
+			uint32_t r = 0;
+			while (r < kOccupancyBuckets && g->freeBuckets[r] <= i)
+				++r;
+			EXPECT_EQ(r, region(g, c));
+			size += c->count;
+		}
+		EXPECT_EQ(size, g->size);
+	}
 	core::database::world ctx;
 };
 
@@ -143,6 +504,139 @@ TEST_F(DatabaseTest, AllocateTenMillion)
 	EXPECT_TRUE(true);
 }
 
+TEST_F(DatabaseTest, Reserve)
+{
+	using namespace core::database;
+	type_index t[] = { tid<test> };
+	entity_type type{ t };
+	archetype_hint hint{ type, 10000 };
+	ctx.reserve(10000, &hint, 1, prefault_mode::touch);
+	auto archetypes = ctx.get_archetypes();
+	ASSERT_EQ(archetypes.size, 1);
+	auto g = archetypes[0];
+	auto chunks = ctx.query(g);
+	auto chunkCount = chunks.size;
+	EXPECT_GT(chunkCount, 0);
+	//touching pages keeps the headers of reserved chunks
+	forloop(i, 0, chunkCount)
+		EXPECT_EQ(chunks[i]->type, g);
+	ctx.allocate(type, 10000);
+	EXPECT_EQ(ctx.query(g).size, chunkCount);
+}
+
+TEST(DSTest, Scratch)
+{
+	using namespace core::database;
+	auto& arena = context::scratch();
+	auto m = arena.mark();
+	void* a = arena.alloc(100);
+	{
+		auto inner = arena.mark();
+		void* big = arena.alloc(kScratchBlockSize * 4); //grow into a new block
+		memset(big, 0, kScratchBlockSize * 4);
+		arena.rewind(inner);
+	}
+	void* b = arena.alloc(100);
+	constexpr ptrdiff_t align = alignof(std::max_align_t);
+	EXPECT_EQ((char*)b - (char*)a, (100 + align - 1) / align * align);
+	arena.rewind(m);
+	EXPECT_EQ(arena.current, m.b);
+	EXPECT_EQ(arena.top, m.top);
+	EXPECT_NE(arena.spare, nullptr); //largest block is kept for reuse
+
+	//every thread owns its own scratch
+	scratch_arena* other = nullptr;
+	std::thread([&] { other = &context::scratch(); }).join();
+	EXPECT_NE(other, &arena);
+}
+
+TEST(DSTest, WorldResource)
+{
+	using namespace core::database;
+	struct counting_resource final : memory_resource_i
+	{
+		int chunks = 0;
+		int buffers = 0;
+		void* malloc(alloc_type type) override { chunks++; return context::default_resource()->malloc(type); }
+		void free(alloc_type type, void* data) override { chunks--; context::default_resource()->free(type, data); }
+		void* buffer_malloc(size_t size) override { buffers++; return ::malloc(size); }
+		void buffer_free(void* data, size_t) override { buffers--; ::free(data); }
+	} resource;
+	type_index t[] = { tid<test> };
+	entity_type type{ t };
+	{
+		world w(4096u, &resource);
+		w.allocate(type, 100);
+		EXPECT_GT(resource.chunks, 0);
+		world dst;
+		dst.move_context(w);
+		EXPECT_EQ(resource.chunks, 0);
+	}
+	EXPECT_EQ(resource.chunks, 0);
+	{
+		//reserve draws from the world's resource and leaves the shared bins alone
+		auto pooled = context::get().get_stats(alloc_type::fastbin).pooledBlocks;
+		world w(4096u, &resource);
+		archetype_hint hint{ type, 1000 };
+		w.reserve(100000, &hint, 1);
+		EXPECT_GT(resource.chunks, 0);
+		EXPECT_EQ(context::get().get_stats(alloc_type::fastbin).pooledBlocks, pooled);
+	}
+	EXPECT_EQ(resource.chunks, 0);
+	void* overflow;
+	{
+		memory_scope scope(&resource);
+		overflow = buffer_malloc(100);
+	}
+	EXPECT_EQ(resource.buffers, 1);
+	buffer_free(overflow);
+	EXPECT_EQ(resource.buffers, 0);
+	{
+		//pipeline tasks and command buffers allocate in the world's scope
+		core::codebase::pipeline ppl(world(4096u, &resource));
+		auto chunks = resource.chunks;
+		{
+			auto scope = ppl.make_scope();
+			overflow = buffer_malloc(100);
+		}
+		EXPECT_EQ(resource.chunks, chunks + 1);
+		buffer_free(overflow);
+	}
+	EXPECT_EQ(resource.chunks, 0);
+}
+
+TEST_F(DatabaseTest, MemoryBudget)
+{
+	using namespace core::database;
+	type_index t[] = { tid<test> };
+	entity_type type{ t };
+	ctx.allocate(type, 100);
+	auto stats = ctx.get_memory_stats();
+	auto g = ctx.get_archetypes()[0];
+	EXPECT_EQ(stats.chunkBytes[0] + stats.chunkBytes[1] + stats.chunkBytes[2], ctx.get_memory(g));
+	EXPECT_GT(stats.entityBytes, 0);
+
+	ctx.budget = stats.total() + kFastBinSize;
+	EXPECT_EQ(ctx.allocate(type, 100000).size, 0);
+	EXPECT_EQ(ctx.get_memory_stats().budgetFailures, 1);
+	EXPECT_EQ(ctx.get_memory_stats().total(), stats.total());
+
+	ctx.on_budget_exceeded = [](world& w, size_t required)
+	{
+		w.budget = required;
+		return true;
+	};
+	EXPECT_GT(ctx.allocate(type, 100000).size, 0);
+	EXPECT_LE(ctx.get_memory_stats().total(), ctx.budget);
+
+	//query caches are accounted as they are built and matched
+	auto queryBytes = ctx.get_memory_stats().queryBytes;
+	ctx.query(archetype_filter{ type });
+	EXPECT_GT(ctx.get_memory_stats().queryBytes, queryBytes);
+	ctx.clear();
+	EXPECT_EQ(ctx.get_memory_stats().queryBytes, 0u);
+}
+
 TEST_F(DatabaseTest, Instatiate)
 {
 	using namespace core::database;
@@ -165,6 +659,26 @@ TEST_F(DatabaseTest, DestroyOne)
 	EXPECT_TRUE(!ctx.exist(e));
 }
 
+TEST_F(DatabaseTest, RecycleVersion)
+{
+	using namespace core::database;
+	entity_type emptyType;
+	ctx.allocate(emptyType); //id 0 is never recycled
+	core::entity first = pick(ctx.allocate(emptyType));
+	core::entity e = first;
+	//reuses of a slot before stale handles alias, 254 for 8 bit versions
+	const uint64_t cycles = std::min<uint64_t>(core::entity::TransientMagicNumber - 1, 1000);
+	for (uint64_t i = 0; i < cycles; ++i)
+	{
+		ctx.destroy(ctx.iter(&e, 1).s);
+		core::entity reused = pick(ctx.allocate(emptyType));
+		ASSERT_EQ(reused.id, first.id);
+		ASSERT_FALSE(ctx.exist(first));
+		e = reused;
+	}
+	EXPECT_TRUE(ctx.exist(e));
+}
+
 TEST_F(DatabaseTest, Cast)
 {
 	using namespace core::database;
@@ -211,6 +725,453 @@ TEST_F(DatabaseTest, CastDiff)
 	EXPECT_TRUE(ctx.has_component(e, { t, 1 }));
 }
 
+TEST_F(DatabaseTest, CastEdge)
+{
+	using namespace core::database;
+	entity_type emptyType;
+	ctx.allocate(emptyType); //keep source archetype alive
+	core::entity e = pick(ctx.allocate(emptyType));
+	archetype* g = ctx.get_archetype(e);
+	type_index t[] = { tid<test> };
+	entity_type type{ t };
+	type_diff diff = { type };
+	archetype* dst = ctx.get_casted(g, diff);
+	EXPECT_EQ(ctx.get_casted(g, diff), dst);
+	ASSERT_NE(g->edges, nullptr);
+	EXPECT_EQ(g->edges->next, nullptr);
+	EXPECT_EQ(dst->edgesIn, g->edges);
+
+	//the last hit moves to the head
+	type_index at[] = { tid<test_align> };
+	type_diff other = { entity_type{ at } };
+	ctx.get_casted(g, other);
+	EXPECT_NE(g->edges->dst, dst);
+	EXPECT_EQ(ctx.get_casted(g, diff), dst);
+	EXPECT_EQ(g->edges->dst, dst);
+
+	//freeing the destination drops edges to it
+	for (auto c : ctx.batch(&e, 1))
+		ctx.cast(c, dst);
+	check_chunks(g);
+	check_chunks(dst);
+	ctx.destroy(ctx.iter(&e, 1).s);
+	ASSERT_NE(g->edges, nullptr);
+	EXPECT_EQ(g->edges->next, nullptr);
+	EXPECT_NE(g->edges->dst, dst);
+	dst = ctx.get_casted(g, diff);
+	EXPECT_EQ(dst, ctx.find_archetype(type));
+}
+
+TEST_F(DatabaseTest, CastPlan)
+{
+	using namespace core::database;
+	type_index t[] = { get_builtin().mask_id, tid<test> };
+	entity_type type{ t };
+	std::vector<core::entity> es;
+	for (auto s : ctx.allocate(type, 1000))
+		es.insert(es.end(), ctx.get_entities(s), ctx.get_entities(s) + s.count);
+	forloop(i, 0, 1000)
+		((test*)ctx.get_owned_rw(es[i], tid<test>))->v = i;
+	type_index tt[] = { tid<test> };
+	ctx.disable_component(es[0], { tt, 1 });
+
+	archetype* g = ctx.get_archetype(es[0]);
+	type_index at[] = { tid<test_align> };
+	type_diff diff = { entity_type{ at } };
+	forloop(i, 0, 10)
+		ctx.cast(ctx.as_slice(es[i]), diff);
+	check_chunks(g);
+	check_chunks(ctx.get_archetype(es[0]));
+	ASSERT_NE(g->plans, nullptr);
+	EXPECT_EQ(g->plans->next, nullptr);
+	EXPECT_EQ(g->plans->dst, ctx.get_archetype(es[0]));
+	for (auto c : ctx.query(g))
+		ctx.cast(chunk_slice(c), diff);
+
+	forloop(i, 0, 1000)
+	{
+		EXPECT_EQ(((const test*)ctx.get_component_ro(es[i], tid<test>))->v, i);
+		EXPECT_EQ(ctx.is_component_enabled(es[i], { tt, 1 }), i != 0);
+		EXPECT_TRUE(ctx.is_component_enabled(es[i], { at, 1 }));
+	}
+}
+
+TEST_F(DatabaseTest, ColumnLookup)
+{
+	using namespace core::database;
+	constexpr int counts[] = { 8, 32, 64 };
+	for (int n : counts)
+	{
+		entity_type type{ typeset{ benchTypes, (core::tsize_t)n } };
+		ctx.allocate(type, 1);
+		archetype* g = ctx.get_archetype(type);
+		type_index probes[kLookupBenchTypes * 2];
+		forloop(i, 0, n)
+		{
+			probes[i * 2] = benchTypes[i];
+			probes[i * 2 + 1] = tid<test_tag>; //miss
+		}
+		auto search = [&](type_index t)
+		{
+			type_index* result = std::lower_bound(g->types, g->types + g->componentCount, t);
+			if (result != g->types + g->componentCount && *result == t)
+				return core::tsize_t(result - g->types);
+			return core::tsize_t(-1);
+		};
+		forloop(i, 0, n * 2)
+			ASSERT_EQ(g->index(probes[i]), search(probes[i]));
+	}
+}
+
+//timing only, run with --gtest_also_run_disabled_tests
+TEST_F(DatabaseTest, DISABLED_ColumnLookupBench)
+{
+	using namespace core::database;
+	constexpr int counts[] = { 8, 32, 64 };
+	int rounds = 200000;
+	for (int n : counts)
+	{
+		entity_type type{ typeset{ benchTypes, (core::tsize_t)n } };
+		ctx.allocate(type, 1);
+		archetype* g = ctx.get_archetype(type);
+		type_index probes[kLookupBenchTypes * 2];
+		forloop(i, 0, n)
+		{
+			probes[i * 2] = benchTypes[i];
+			probes[i * 2 + 1] = tid<test_tag>;
+		}
+		auto search = [&](type_index t)
+		{
+			type_index* result = std::lower_bound(g->types, g->types + g->componentCount, t);
+			if (result != g->types + g->componentCount && *result == t)
+				return core::tsize_t(result - g->types);
+			return core::tsize_t(-1);
+		};
+		size_t sumHash = 0, sumSearch = 0;
+		auto t0 = std::chrono::high_resolution_clock::now();
+		forloop(r, 0, rounds)
+			sumHash += g->index(probes[r % (n * 2)]);
+		auto t1 = std::chrono::high_resolution_clock::now();
+		forloop(r, 0, rounds)
+			sumSearch += search(probes[r % (n * 2)]);
+		auto t2 = std::chrono::high_resolution_clock::now();
+		EXPECT_EQ(sumHash, sumSearch);
+		using ns = std::chrono::duration<double, std::nano>;
+		printf("[ lookup   ] %2d components: hash %.2fns, binary search %.2fns\n", n,
+			ns(t1 - t0).count() / rounds, ns(t2 - t1).count() / rounds);
+	}
+}
+
+TEST_F(DatabaseTest, QueryIndex)
+{
+	using namespace core::database;
+	type_index all[] = { tid<test> };
+	type_index any[] = { tid<test_track>, tid<test_align> };
+	type_index none[] = { tid<test_tag> };
+	archetype_filter filters[] = {
+		{ entity_type{ all } },
+		{ {}, entity_type{ any } },
+		{ {}, {}, entity_type{ none } } //unanchored
+	};
+	for (auto& f : filters)
+		ctx.query(f);
+
+	type_index t0[] = { tid<test> };
+	type_index t1[] = { tid<test>, tid<test_track> };
+	type_index t2[] = { tid<test_align>, tid<test_tag> };
+	type_index t3[] = { tid<test_track>, tid<test_align> };
+	entity_type types[] = { entity_type{ t0 }, entity_type{ t1 }, entity_type{ t2 }, entity_type{ t3 } };
+	std::vector<chunk_slice> slices;
+	for (auto& t : types)
+		for (auto s : ctx.allocate(t, 10))
+			slices.push_back(s);
+
+	auto check = [&]
+	{
+		for (auto& f : filters)
+		{
+			std::vector<archetype*> expected;
+			for (auto g : ctx.get_archetypes())
+				if (!g->cleaning && f.match({ typeset{ g->types, g->componentCount }, metaset{ g->metatypes, g->metaCount } }, {}))
+					expected.push_back(g);
+			std::vector<archetype*> cached;
+			for (auto ma : ctx.query(f))
+			{
+				cached.push_back(ma.type);
+				EXPECT_EQ(ma.matched, ma.type->get_mask(typeset::merge(f.all.types, f.any.types, (type_index*)alloca(sizeof(type_index) * 3))));
+			}
+			std::sort(expected.begin(), expected.end());
+			std::sort(cached.begin(), cached.end());
+			EXPECT_EQ(expected, cached);
+		}
+	};
+	check();
+	EXPECT_EQ(ctx.query(filters[0]).size, 2);
+	EXPECT_EQ(ctx.query(filters[1]).size, 3);
+	EXPECT_EQ(ctx.query(filters[2]).size, 3);
+
+	//archetypes die in the middle of the caches
+	ctx.destroy(slices[1]);
+	ctx.destroy(slices[2]);
+	check();
+	EXPECT_EQ(ctx.query(filters[0]).size, 1);
+	EXPECT_EQ(ctx.query(filters[1]).size, 1);
+}
+
+TEST_F(DatabaseTest, QueryView)
+{
+	using namespace core::database;
+	type_index ta[] = { tid<test> };
+	type_index tb[] = { tid<test>, tid<test_track> };
+	ctx.allocate(entity_type{ ta }, 10);
+	core::entity e;
+	for (auto s : ctx.allocate(entity_type{ tb }, 10))
+		e = ctx.get_entities(s.c)[s.start];
+
+	archetype_filter filter{ entity_type{ ta } };
+	auto copied = ctx.query(filter);
+	auto view = ctx.each_archetype(filter);
+	ASSERT_EQ(view.size(), copied.size);
+	int i = 0;
+	for (auto& ma : view)
+	{
+		EXPECT_EQ(ma.type, copied[i++].type);
+		int count = 0;
+		for (auto c : ctx.each_chunk(ma.type))
+			count += c->count > 0;
+		EXPECT_EQ(count, ctx.query(ma.type).size);
+	}
+
+	ctx.inc_timestamp();
+	chunk_filter changed{ entity_type{ ta }.types, (uint32_t)ctx.get_timestamp() };
+	ctx.get_owned_rw(e, tid<test>);
+	for (auto& ma : ctx.each_archetype(filter))
+	{
+		int count = 0;
+		for (auto c : ctx.each_chunk(ma.type, changed))
+		{
+			EXPECT_EQ(c, ctx.as_slice(e).c);
+			count++;
+		}
+		EXPECT_EQ(count, ma.type == ctx.get_archetype(e) ? 1 : 0);
+	}
+}
+
+TEST_F(DatabaseTest, ChunkTable)
+{
+	using namespace core::database;
+	type_index t[] = { tid<test> };
+	auto es = allocate_batches(entity_type{ t }, 100, 50);
+	archetype* g = ctx.get_archetype(es[0]);
+	check_chunks(g);
+
+	//punch holes into every chunk
+	for (size_t i = 0; i < es.size(); i += 3)
+		ctx.destroy(&es[i], 1);
+	check_chunks(g);
+	//release a whole chunk
+	chunk* victim = g->chunks[g->chunkCount - 1];
+	ctx.destroy(chunk_slice{ victim, 0, victim->count });
+	check_chunks(g);
+	uint32_t before = g->chunkCount;
+	EXPECT_GT(before, 1u);
+
+	ctx.merge_chunks();
+	check_chunks(g);
+	EXPECT_LT(g->chunkCount, before);
+	EXPECT_GE(g->freeBuckets[0] + 1, g->chunkCount);
+}
+
+TEST_F(DatabaseTest, ChunkOccupancy)
+{
+	using namespace core::database;
+	type_index t[] = { tid<test> };
+	auto es = allocate_batches(entity_type{ t }, 100, 50);
+	archetype* g = ctx.get_archetype(es[0]);
+
+	//empty some chunks more than others
+	for (size_t i = 0; i < es.size(); i += i % 7 + 1)
+		ctx.destroy(&es[i], 1);
+	check_chunks(g);
+
+	//new entities go to the fullest chunk with free slots
+	uint32_t best = kOccupancyBuckets;
+	forloop(i, 0u, g->chunkCount)
+		if (region(g, g->chunks[i]) != 0)
+			best = std::min(best, region(g, g->chunks[i]));
+	ASSERT_LT(best, kOccupancyBuckets);
+	auto slice = *ctx.allocate(entity_type{ t }, 1).begin();
+	EXPECT_LE(region(g, slice.c), best);
+	check_chunks(g);
+
+	//emptying a whole chunk releases it and keeps the entity count
+	chunk* victim = g->chunks[0];
+	ctx.destroy(chunk_slice{ victim, 0, victim->count });
+	check_chunks(g);
+
+	auto stats = ctx.get_archetype_stats(g);
+	uint64_t capacity = 0, entities = 0;
+	forloop(i, 0u, g->chunkCount)
+	{
+		capacity += g->chunkCapacity[(int)g->chunks[i]->ct];
+		entities += g->chunks[i]->count;
+	}
+	EXPECT_EQ(stats.capacity, capacity);
+	EXPECT_EQ(stats.entities, entities);
+	EXPECT_EQ(g->size, entities);
+	EXPECT_LT(stats.occupancy(), 1.f);
+	uint32_t freeChunks = 0;
+	forloop(b, 0u, kOccupancyBuckets)
+		freeChunks += stats.freeChunks[b];
+	EXPECT_EQ(freeChunks, g->chunkCount - g->freeBuckets[0]);
+
+	ctx.merge_chunks();
+	check_chunks(g);
+	EXPECT_GT(ctx.get_archetype_stats(g).occupancy(), stats.occupancy());
+}
+
+TEST_F(DatabaseTest, Defragment)
+{
+	using namespace core::database;
+	type_index t[] = { tid<test> };
+	auto es = allocate_batches(entity_type{ t }, 100, 50);
+	std::vector<core::entity> alive;
+	forloop(i, 0, (int)es.size())
+	{
+		if (i % 3 != 0)
+			ctx.destroy(&es[i], 1);
+		else
+		{
+			((test*)ctx.get_owned_rw(es[i], tid<test>))->v = i;
+			alive.push_back(es[i]);
+		}
+	}
+	archetype* g = ctx.get_archetype(alive[0]);
+	uint32_t before = g->chunkCount;
+	float occupancy = ctx.get_archetype_stats(g).occupancy();
+
+	//a small budget spreads the work over several calls
+	size_t budget = g->entitySize * 100;
+	int calls = 0;
+	size_t moved;
+	while ((moved = ctx.defragment(defrag_budget{ budget })) != 0)
+	{
+		EXPECT_LE(moved, budget);
+		calls++;
+	}
+	EXPECT_GT(calls, 1);
+	check_chunks(g);
+	EXPECT_LT(g->chunkCount, before);
+	EXPECT_GT(ctx.get_archetype_stats(g).occupancy(), occupancy);
+	auto stats = ctx.get_memory_stats();
+	EXPECT_GT(stats.defragBytes, 0u);
+	EXPECT_EQ(stats.defragChunks, before - g->chunkCount);
+
+	forloop(i, 0, (int)alive.size())
+	{
+		ASSERT_TRUE(ctx.exist(alive[i]));
+		EXPECT_EQ(((const test*)ctx.get_component_ro(alive[i], tid<test>))->v, i * 3);
+	}
+}
+
+TEST_F(DatabaseTest, ChunkClass)
+{
+	using namespace core::database;
+	auto& runtime = context::get();
+	EXPECT_EQ(runtime.get_bin_size(alloc_type::fastbin), kFastBinSize);
+	EXPECT_FALSE(runtime.set_bin_size(alloc_type::fastbin, 16 * 1024));
+	EXPECT_FALSE(runtime.set_bin_size(alloc_type::smallbin, 3000));
+	EXPECT_FALSE(runtime.set_bin_size(alloc_type::largebin, 16 * 1024));
+
+	//wide archetypes skip small chunks
+	type_index wide[20];
+	std::copy(benchTypes, benchTypes + 20, wide);
+	std::sort(wide, wide + 20);
+	auto slices = ctx.allocate(entity_type{ wide }, 1);
+	EXPECT_EQ(slices[0].c->ct, alloc_type::fastbin);
+
+	//narrow archetypes start small and move on once they keep growing
+	type_index t[] = { tid<test> };
+	archetype* g = nullptr;
+	forloop(k, 0, 100)
+		for (auto s : ctx.allocate(entity_type{ t }, 10))
+			g = s.c->type;
+	ASSERT_NE(g, nullptr);
+	EXPECT_EQ(g->chunkClass, alloc_type::fastbin);
+	int small = 0;
+	forloop(i, 0u, g->chunkCount)
+		small += g->chunks[i]->ct == alloc_type::smallbin;
+	EXPECT_GT(small, 0);
+	EXPECT_LE(small, (int)kSmallBinThreshold);
+	//small blocks were handed out, a valid size is still refused
+	EXPECT_FALSE(runtime.set_bin_size(alloc_type::smallbin, 2 * 1024));
+	forloop(k, 0, 49)
+		ctx.allocate(entity_type{ t }, 1000);
+
+	//merge_chunks upgrades archetypes filling half a large chunk
+	ASSERT_GE(g->size, g->chunkCapacity[(int)alloc_type::largebin] / 2);
+	ctx.merge_chunks();
+	EXPECT_EQ(g->chunkClass, alloc_type::largebin);
+	EXPECT_EQ(g->chunkCount, 1u);
+	EXPECT_EQ(g->chunks[0]->ct, alloc_type::largebin);
+	EXPECT_EQ(g->size, 50000u);
+}
+
+TEST(DSTest, BinSize)
+{
+	using namespace core::database;
+	//sizes lock once blocks are handed out, configure them in a fresh process
+	::testing::FLAGS_gtest_death_test_style = "threadsafe";
+	auto run = []
+	{
+		auto& runtime = context::get();
+		type_index t[] = { tid<test> };
+		{
+			//archetypes are laid out for the current sizes, even before their first block
+			world w;
+			w.get_archetype(entity_type{ t });
+			if (runtime.set_bin_size(alloc_type::largebin, 128 * 1024))
+				return 5;
+		}
+		if (!runtime.set_bin_size(alloc_type::smallbin, 16 * 1024))
+			return 1;
+		world w;
+		chunk* c = w.allocate(entity_type{ t }, 1)[0].c;
+		archetype* g = c->type;
+		if (c->ct != alloc_type::smallbin || c->get_size() != 16 * 1024)
+			return 2;
+		size_t used = (size_t)g->chunkCapacity[(int)alloc_type::smallbin] * g->entitySize;
+		if (used <= 8 * 1024 || used > 16 * 1024)
+			return 3;
+		if (runtime.set_bin_size(alloc_type::smallbin, 32 * 1024))
+			return 4;
+		return 0;
+	};
+	EXPECT_EXIT(exit(run()), ::testing::ExitedWithCode(0), "");
+}
+
+TEST_F(DatabaseTest, ColumnAlignment)
+{
+	using namespace core::database;
+	auto& runtime = context::get();
+	type_index t[5];
+	std::copy(benchTypes, benchTypes + 5, t);
+	std::sort(t, t + 5);
+	runtime.columnAlignment = 64;
+	auto slices = ctx.allocate(entity_type{ t }, 100);
+	runtime.columnAlignment = 0;
+	auto c = slices[0].c;
+	auto g = c->type;
+	EXPECT_EQ((size_t)c % kChunkAlignment, 0u);
+	//int columns need capacities padded to 16 entities to keep every column on a cache line
+	forloop(i, 0, 3)
+		EXPECT_EQ(g->chunkCapacity[i] % 16, 0u);
+	forloop(i, 0, (int)g->firstTag)
+		EXPECT_EQ((size_t)(c->data() + g->offsets[(int)c->ct][i]) % 64, 0u);
+	auto stats = ctx.get_archetype_stats(g);
+	EXPECT_GT(stats.paddingBytes + stats.slackBytes, 0u);
+}
+
 TEST_F(DatabaseTest, Batch)
 {
 	using namespace core::database;
@@ -363,6 +1324,124 @@ TEST_F(DatabaseTest, BufferInstatiate)
 	ctx.destroy(ctx.iter(&e2, 1).s); //ctx.destroy(e2);
 }
 
+TEST_F(DatabaseTest, WideBuffer)
+{
+	using namespace core::database;
+	type_index t[] = { tid<test_element> };
+	entity_type type{ t };
+	core::entity e = pick(ctx.allocate(type));
+	constexpr int count = 40000; //160KB, beyond 16 bit sizes
+	{
+		buffer_t<test_element> b(ctx.get_owned_rw(e, tid<test_element>));
+		forloop(i, 0, count)
+			b.push(test_element{ i });
+		EXPECT_EQ(b.size(), count);
+		EXPECT_EQ(b.last().v, count - 1);
+	}
+	core::entity e2 = pick(ctx.instantiate(e));
+	buffer_t<test_element> b2(ctx.get_owned_rw(e2, tid<test_element>));
+	EXPECT_EQ(b2.size(), count);
+	EXPECT_EQ(b2[count - 1].v, count - 1);
+
+	//shrinking below inline size moves data back into the chunk
+	b2.resize(2);
+	b2.shrink(128 - sizeof(buffer));
+	EXPECT_EQ(b2.size(), 2);
+	EXPECT_EQ(b2[1].v, 1);
+	EXPECT_EQ(ctx.get_buffer_stats().overflowBuffers, 1);
+}
+
+TEST_F(DatabaseTest, BufferHeap)
+{
+	using namespace core::database;
+	type_index t[] = { tid<test_element> };
+	entity_type type{ t };
+	core::entity e = pick(ctx.allocate(type));
+	{
+		auto scope = ctx.make_scope();
+		buffer_t<test_element> b(ctx.get_owned_rw(e, tid<test_element>));
+		forloop(i, 0, 64)
+			b.push(test_element{ i });
+	}
+	auto src = ctx.get_buffer_stats();
+	EXPECT_EQ(src.overflowBuffers, 1);
+	EXPECT_GE(src.heapAllocs, 1);
+
+	for (auto s : ctx.instantiate(e, 100))
+		ctx.destroy(s);
+	auto stats = ctx.get_buffer_stats();
+	EXPECT_EQ(stats.heapAllocs, src.heapAllocs + 100);
+	EXPECT_EQ(stats.overflowBuffers, 1);
+	EXPECT_EQ(stats.slabBytes, kFastBinSize);
+
+	//destroyed clones went back to the pool
+	auto copies = ctx.instantiate(e, 100);
+	EXPECT_GE(ctx.get_buffer_stats().heapReuses, 100);
+	auto b2 = buffer_t<test_element>(ctx.get_component_ro(ctx.get_entities(copies[0].c)[copies[0].start], tid<test_element>));
+	EXPECT_EQ(b2.size(), 64);
+	EXPECT_EQ(b2[63].v, 63);
+}
+
+TEST_F(DatabaseTest, BufferHeapTrim)
+{
+	using namespace core::database;
+	type_index t[] = { tid<test_element> };
+	entity_type type{ t };
+	core::entity e = pick(ctx.allocate(type));
+	{
+		auto scope = ctx.make_scope();
+		buffer_t<test_element> b(ctx.get_owned_rw(e, tid<test_element>));
+		forloop(i, 0, 64)
+			b.push(test_element{ i });
+	}
+	auto copies = ctx.instantiate(e, 1000);
+	EXPECT_GT(ctx.get_buffer_stats().slabBytes, 2 * kFastBinSize);
+
+	//slabs emptied with their chunks go back, the source's slab and the open one stay
+	for (auto s : copies)
+		ctx.destroy(s);
+	EXPECT_LE(ctx.get_buffer_stats().slabBytes, 2 * kFastBinSize);
+	auto reuses = ctx.get_buffer_stats().heapReuses;
+	ctx.instantiate(e, 10);
+	EXPECT_EQ(ctx.get_buffer_stats().heapReuses, reuses + 10);
+}
+
+TEST_F(DatabaseTest, AdaptiveBuffer)
+{
+	using namespace core::database;
+	type_index t[] = { tid<test>, tid<test_adaptive> };
+	entity_type type{ t };
+	core::entity es[100];
+	forloop(i, 0, 100)
+	{
+		es[i] = pick(ctx.allocate(type));
+		((test*)ctx.get_owned_rw(es[i], tid<test>))->v = i;
+		buffer_t<test_adaptive> b(ctx.get_owned_rw(es[i], tid<test_adaptive>));
+		int size = i < 95 ? 20 : 2;
+		forloop(j, 0, size)
+			b.push(test_adaptive{ j });
+	}
+	EXPECT_EQ(ctx.get_buffer_stats().overflowBuffers, 95);
+
+	//90% of buffers fit 32 elements
+	EXPECT_EQ(ctx.adapt_buffers(), 1);
+	EXPECT_EQ(ctx.get_size(tid<test_adaptive>), sizeof(buffer) + 32 * sizeof(test_adaptive));
+	EXPECT_EQ(ctx.get_buffer_stats().overflowBuffers, 0);
+	EXPECT_EQ(ctx.adapt_buffers(), 0);
+	forloop(i, 0, 100)
+	{
+		EXPECT_EQ(((const test*)ctx.get_component_ro(es[i], tid<test>))->v, i);
+		buffer_t<test_adaptive> b(ctx.get_component_ro(es[i], tid<test_adaptive>));
+		EXPECT_EQ(b.size(), i < 95 ? 20u : 2u);
+		EXPECT_EQ(b.last().v, (int)b.size() - 1);
+	}
+
+	//moving into a world of registered layout spills them again
+	world dst;
+	dst.move_context(ctx);
+	EXPECT_EQ(dst.get_buffer_stats().overflowBuffers, 95);
+}
+
 TEST_F(DatabaseTest, Meta) 
 {
 	using namespace core::database;
@@ -762,6 +1841,12 @@ TEST_F(DatabaseTest, Deserialize)
 				counter2 += tests[k].v;
 		}
 	EXPECT_EQ(counter2, 5050);
+
+	//streams without the version header are rejected
+	std::vector<char> old(64, 0);
+	buffer_deserializer ods{ old };
+	EXPECT_FALSE(ctx2.deserialize(&ods));
+	EXPECT_EQ(ctx2.get_archetypes().size, 0u);
 }
 
 TEST_F(DatabaseTest, EntityDeserialize) 
@@ -777,6 +1862,9 @@ TEST_F(DatabaseTest, EntityDeserialize)
 	ctx.serialize(&bs, e);
 	auto e2 = ctx.deserialize(&ds, nullptr);
 	EXPECT_EQ(((test*)ctx.get_component_ro(e2, tid<test>))->v, -1.f);
+	buffer[0]++;
+	buffer_deserializer ds2{ buffer };
+	EXPECT_EQ(ctx.deserialize(&ds2, nullptr), core::NullEntity);
 }
 
 TEST_F(DatabaseTest, GroupDeserialize)
@@ -899,4 +1987,19 @@ void install_test_components()
 	tid<test_tag> = register_type({ false, false, false, false,
 		"6AB0D784-CD4A-4EB1-8CF9-EE8C6BADEB81"_guid,
 		0 });
+	{
+		component_desc desc;
+		desc.isElement = true; desc.GUID = "0B1D4E3A-6C2F-4D8B-9E57-3A1F20C4B6D9"_guid;
+		desc.size = sizeof(buffer) + 4 * sizeof(test_adaptive); desc.elementSize = sizeof(test_adaptive);
+		desc.adaptiveCapacity = true;
+		tid<test_adaptive> = register_type(desc);
+	}
+	forloop(i, 0, (int)kLookupBenchTypes)
+	{
+		component_desc desc;
+		desc.GUID = "5A0C3E51-7B2D-4F6A-9C18-D40000000000"_guid;
+		desc.GUID.Data4[7] = (uint8_t)i;
+		desc.size = sizeof(int);
+		benchTypes[i] = register_type(desc);
+	}
 }
\ No newline at end of file
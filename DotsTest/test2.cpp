@@ -408,9 +408,11 @@ TEST_F(CodebaseTest, CommandBuffer)
 	local.set_component(test2{ 121 });
 	buffer.execute(ppl);
 	for(auto ma : ppl.query(archetype_filter{ {complist<test2>} }))
+	{
+		EXPECT_FALSE(ppl.has_component(ma.type, complist<test>)); //shrink applied to the recorded allocate
 		for(auto s : ppl.query(ma.type))
 			EXPECT_EQ(((test2*)ppl.get_component_ro(s, cid<test2>))->v, 121);
-			
+	}
 }
 
 TEST_F(CodebaseTest, Dependency)